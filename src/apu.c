@@ -4,21 +4,14 @@
 
 static uint8_t duties[4] = {1, 2, 4, 6};
 
-apu_t *apu_new(mem_t *mem)
+void apu_init(apu_t *apu, mem_t *mem)
 {
-	apu_t *apu = calloc(sizeof(*apu), 1);
-	if (!apu)
-		return NULL;
-
 	apu->mem = mem;
-	return apu;
 }
 
-void apu_del(apu_t *apu)
+void apu_rebase(apu_t *apu, ptrdiff_t delta)
 {
-	if (!apu)
-		return;
-	free(apu);
+	MEM_REBASE(apu->mem, delta);
 }
 
 static uint8_t channel1(apu_t *apu)
@@ -1,6 +1,7 @@
 #ifndef APU_H
 #define APU_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define APU_FRAME_SAMPLES 804
@@ -26,7 +27,6 @@ typedef struct apu_env_s
 
 typedef struct apu_s
 {
-	uint16_t data[APU_FRAME_SAMPLES];
 	uint32_t sample;
 	uint32_t clock;
 	uint8_t wave1_haslen;
@@ -60,10 +60,11 @@ typedef struct apu_s
 	uint8_t fifo2_val;
 	uint32_t timer;
 	mem_t *mem;
+	uint16_t data[APU_FRAME_SAMPLES];
 } apu_t;
 
-apu_t *apu_new(mem_t *mem);
-void apu_del(apu_t *apu);
+void apu_init(apu_t *apu, mem_t *mem);
+void apu_rebase(apu_t *apu, ptrdiff_t delta);
 
 void apu_cycle(apu_t *apu);
 
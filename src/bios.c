@@ -0,0 +1,611 @@
+#include "bios.h"
+#include "cpu.h"
+#include "mem.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * high level emulation of the bios swi functions
+ *
+ * the cycles charged for a routine are the ARM7TDMI timings of its
+ * instructions with the bios fetched without waitstates: 1 per data
+ * processing instruction, 3 per load, taken branch or multiply, 2 per
+ * store, n + 2 per ldm and n + 1 per stm of n registers. the waitstates
+ * of the data accesses are not part of them, the mem accessors charge
+ * them from the waitstate tables like for any other instruction
+ */
+
+#define BIOS_IRQ_FLAGS 0x03007FF8
+
+/*
+ * swi exception (3), saving r11, r12 and lr (4), reading the comment
+ * field (8), table lookup (6), switch to system mode (7), call (4) and
+ * return (3), then the way back to the caller (18), minus the cycle of
+ * the swi instruction itself
+ */
+#define SWI_CYCLES 52
+
+/* square (5), 7 multiply, shift and add steps (5 each), final product (4) */
+#define ARCTAN_CYCLES 44
+
+/* sin(i * 2 * pi / 256) in 1.14 fixed point */
+static const int16_t sin_lut[256] =
+{
+	0, 402, 804, 1205, 1606, 2006, 2404, 2801,
+	3196, 3590, 3981, 4370, 4756, 5139, 5520, 5897,
+	6270, 6639, 7005, 7366, 7723, 8076, 8423, 8765,
+	9102, 9434, 9760, 10080, 10394, 10702, 11003, 11297,
+	11585, 11866, 12140, 12406, 12665, 12916, 13160, 13395,
+	13623, 13842, 14053, 14256, 14449, 14635, 14811, 14978,
+	15137, 15286, 15426, 15557, 15679, 15791, 15893, 15986,
+	16069, 16143, 16207, 16261, 16305, 16340, 16364, 16379,
+	16384, 16379, 16364, 16340, 16305, 16261, 16207, 16143,
+	16069, 15986, 15893, 15791, 15679, 15557, 15426, 15286,
+	15137, 14978, 14811, 14635, 14449, 14256, 14053, 13842,
+	13623, 13395, 13160, 12916, 12665, 12406, 12140, 11866,
+	11585, 11297, 11003, 10702, 10394, 10080, 9760, 9434,
+	9102, 8765, 8423, 8076, 7723, 7366, 7005, 6639,
+	6270, 5897, 5520, 5139, 4756, 4370, 3981, 3590,
+	3196, 2801, 2404, 2006, 1606, 1205, 804, 402,
+	0, -402, -804, -1205, -1606, -2006, -2404, -2801,
+	-3196, -3590, -3981, -4370, -4756, -5139, -5520, -5897,
+	-6270, -6639, -7005, -7366, -7723, -8076, -8423, -8765,
+	-9102, -9434, -9760, -10080, -10394, -10702, -11003, -11297,
+	-11585, -11866, -12140, -12406, -12665, -12916, -13160, -13395,
+	-13623, -13842, -14053, -14256, -14449, -14635, -14811, -14978,
+	-15137, -15286, -15426, -15557, -15679, -15791, -15893, -15986,
+	-16069, -16143, -16207, -16261, -16305, -16340, -16364, -16379,
+	-16384, -16379, -16364, -16340, -16305, -16261, -16207, -16143,
+	-16069, -15986, -15893, -15791, -15679, -15557, -15426, -15286,
+	-15137, -14978, -14811, -14635, -14449, -14256, -14053, -13842,
+	-13623, -13395, -13160, -12916, -12665, -12406, -12140, -11866,
+	-11585, -11297, -11003, -10702, -10394, -10080, -9760, -9434,
+	-9102, -8765, -8423, -8076, -7723, -7366, -7005, -6639,
+	-6270, -5897, -5520, -5139, -4756, -4370, -3981, -3590,
+	-3196, -2801, -2404, -2006, -1606, -1205, -804, -402,
+};
+
+typedef struct bios_out_s
+{
+	mem_t *mem;
+	uint32_t dst;
+	uint16_t pending;
+	bool vram;
+	uint32_t cycles;
+} bios_out_t;
+
+/*
+ * vram can't be written by bytes: the vram variants of the decompressors
+ * buffer halfwords (orr, tst and add per byte, strh every other byte)
+ */
+static void out_put(bios_out_t *out, uint8_t v)
+{
+	if (!out->vram)
+	{
+		mem_set8(out->mem, out->dst, v);
+		out->cycles += 2;
+	}
+	else if (out->dst & 1)
+	{
+		mem_set16(out->mem, out->dst & ~1, out->pending | (v << 8));
+		out->cycles += 5;
+	}
+	else
+	{
+		out->pending = v;
+		out->cycles += 3;
+	}
+	out->dst++;
+}
+
+static uint8_t out_get(bios_out_t *out, uint32_t disp)
+{
+	out->cycles += 3;
+	if (out->vram && disp == 1 && (out->dst & 1))
+		return out->pending;
+	return mem_get8(out->mem, out->dst - disp);
+}
+
+static uint32_t div_loops(uint32_t num, uint32_t den)
+{
+	uint32_t loops = 1;
+	while (den < num && !(den & (1u << 31)))
+	{
+		den <<= 1;
+		loops++;
+	}
+	return loops;
+}
+
+/* operand signs (11), an alignment (6) and a subtract (8) step per quotient bit, result signs (11) */
+static uint32_t div_cycles(int32_t num, int32_t den)
+{
+	uint32_t unum = num < 0 ? -(uint32_t)num : (uint32_t)num;
+	uint32_t uden = den < 0 ? -(uint32_t)den : (uint32_t)den;
+	return 22 + 14 * div_loops(unum, uden);
+}
+
+static uint32_t swi_div(cpu_t *cpu, int32_t num, int32_t den)
+{
+	if (!den)
+	{
+		/* the bios never returns from a division by zero */
+		cpu_set_reg(cpu, 0, num < 0 ? -1 : 1);
+		cpu_set_reg(cpu, 1, num);
+		cpu_set_reg(cpu, 3, 1);
+		return 11;
+	}
+	if (num == INT32_MIN && den == -1)
+	{
+		cpu_set_reg(cpu, 0, num);
+		cpu_set_reg(cpu, 1, 0);
+		cpu_set_reg(cpu, 3, num);
+		return 22;
+	}
+	int32_t q = num / den;
+	int32_t r = num % den;
+	cpu_set_reg(cpu, 0, q);
+	cpu_set_reg(cpu, 1, r);
+	cpu_set_reg(cpu, 3, q < 0 ? -q : q);
+	return div_cycles(num, den);
+}
+
+/* setup (3) and 16 steps of add, cmp, subhs, movhs, addhs, movlo, movs and bne (10 each) */
+static uint32_t swi_sqrt(cpu_t *cpu)
+{
+	uint32_t v = cpu_get_reg(cpu, 0);
+	uint32_t res = 0;
+	uint32_t bit = 1u << 30;
+	while (bit > v)
+		bit >>= 2;
+	while (bit)
+	{
+		if (v >= res + bit)
+		{
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		}
+		else
+		{
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+	cpu_set_reg(cpu, 0, res);
+	return 3 + 16 * 10;
+}
+
+static int32_t arctan(int32_t v, int32_t *r1, int32_t *r3)
+{
+	int32_t a = -((v * v) >> 14);
+	int32_t b = ((0xA9 * a) >> 14) + 0x390;
+	b = ((b * a) >> 14) + 0x91C;
+	b = ((b * a) >> 14) + 0xFB6;
+	b = ((b * a) >> 14) + 0x16AA;
+	b = ((b * a) >> 14) + 0x2081;
+	b = ((b * a) >> 14) + 0x3651;
+	b = ((b * a) >> 14) + 0xA2F9;
+	if (r1)
+		*r1 = a;
+	if (r3)
+		*r3 = b;
+	return (v * b) >> 16;
+}
+
+static uint32_t swi_arctan(cpu_t *cpu)
+{
+	int32_t r1;
+	int32_t r3;
+	int32_t res = arctan((int16_t)cpu_get_reg(cpu, 0), &r1, &r3);
+	cpu_set_reg(cpu, 0, res);
+	cpu_set_reg(cpu, 1, r1);
+	cpu_set_reg(cpu, 3, r3);
+	return ARCTAN_CYCLES;
+}
+
+/* quadrant tests (10), a Div call, arctan and the quadrant offset (2) */
+static uint32_t swi_arctan2(cpu_t *cpu)
+{
+	int32_t x = (int16_t)cpu_get_reg(cpu, 0);
+	int32_t y = (int16_t)cpu_get_reg(cpu, 1);
+	int32_t res;
+	if (!y)
+	{
+		cpu_set_reg(cpu, 0, x >= 0 ? 0 : 0x8000);
+		return 8;
+	}
+	if (!x)
+	{
+		cpu_set_reg(cpu, 0, y >= 0 ? 0x4000 : 0xC000);
+		return 8;
+	}
+	/* the smaller coordinate is always divided by the larger one */
+	int32_t ax = x < 0 ? -x : x;
+	int32_t ay = y < 0 ? -y : y;
+	uint32_t cycles = 10 + div_cycles((ax < ay ? ax : ay) * 0x4000, ax < ay ? ay : ax) + ARCTAN_CYCLES + 2;
+	if (y >= 0)
+	{
+		if (x >= 0 && x >= y)
+			res = arctan(y * 0x4000 / x, NULL, NULL);
+		else if (x < 0 && -x >= y)
+			res = arctan(y * 0x4000 / x, NULL, NULL) + 0x8000;
+		else
+			res = 0x4000 - arctan(x * 0x4000 / y, NULL, NULL);
+	}
+	else
+	{
+		if (x <= 0 && -x > -y)
+			res = arctan(y * 0x4000 / x, NULL, NULL) + 0x8000;
+		else if (x > 0 && x >= -y)
+			res = arctan(y * 0x4000 / x, NULL, NULL) + 0x10000;
+		else
+			res = 0xC000 - arctan(x * 0x4000 / y, NULL, NULL);
+	}
+	cpu_set_reg(cpu, 0, res & 0xFFFF);
+	return cycles;
+}
+
+/* setup (8), ldr, str, subs and bgt (9) per unit, or str, subs and bgt (6) when filling */
+static uint32_t swi_cpuset(cpu_t *cpu)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	uint32_t dst = cpu_get_reg(cpu, 1);
+	uint32_t cnt = cpu_get_reg(cpu, 2);
+	uint32_t len = cnt & 0x1FFFFF;
+	bool fill = cnt & (1 << 24);
+	if (!(src & 0x0E000000))
+		return 4;
+	if (cnt & (1 << 26))
+	{
+		src &= ~3;
+		dst &= ~3;
+		uint32_t v = mem_get32(mem, src);
+		for (uint32_t i = 0; i < len; ++i)
+		{
+			if (!fill)
+				v = mem_get32(mem, src + i * 4);
+			mem_set32(mem, dst + i * 4, v);
+		}
+	}
+	else
+	{
+		src &= ~1;
+		dst &= ~1;
+		uint16_t v = mem_get16(mem, src);
+		for (uint32_t i = 0; i < len; ++i)
+		{
+			if (!fill)
+				v = mem_get16(mem, src + i * 2);
+			mem_set16(mem, dst + i * 2, v);
+		}
+	}
+	return 8 + len * (fill ? 6 : 9);
+}
+
+/*
+ * setup (8), ldmia, stmia, subs and bgt of 8 words (23) per block, or
+ * loading the value in 8 registers (10) then stmia, subs and bgt (13) per
+ * block when filling
+ */
+static uint32_t swi_cpufastset(cpu_t *cpu)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0) & ~3;
+	uint32_t dst = cpu_get_reg(cpu, 1) & ~3;
+	uint32_t cnt = cpu_get_reg(cpu, 2);
+	uint32_t len = ((cnt & 0x1FFFFF) + 7) & ~7;
+	bool fill = cnt & (1 << 24);
+	if (!(src & 0x0E000000))
+		return 4;
+	uint32_t v = mem_get32(mem, src);
+	for (uint32_t i = 0; i < len; ++i)
+	{
+		if (!fill)
+			v = mem_get32(mem, src + i * 4);
+		mem_set32(mem, dst + i * 4, v);
+	}
+	return fill ? 18 + (len / 8) * 13 : 8 + (len / 8) * 23;
+}
+
+/*
+ * per entry: loads (19), sin and cos lookup (9), scaled parameters (17),
+ * start point (16), stores (12) and loop (4)
+ */
+static uint32_t swi_bgaffineset(cpu_t *cpu)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	uint32_t dst = cpu_get_reg(cpu, 1);
+	uint32_t n = cpu_get_reg(cpu, 2);
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		int32_t ox = mem_get32(mem, src + 0x0);
+		int32_t oy = mem_get32(mem, src + 0x4);
+		int16_t cx = mem_get16(mem, src + 0x8);
+		int16_t cy = mem_get16(mem, src + 0xA);
+		int16_t sx = mem_get16(mem, src + 0xC);
+		int16_t sy = mem_get16(mem, src + 0xE);
+		uint8_t theta = mem_get16(mem, src + 0x10) >> 8;
+		int32_t sin = sin_lut[theta];
+		int32_t cos = sin_lut[(uint8_t)(theta + 0x40)];
+		int16_t pa = (sx * cos) >> 14;
+		int16_t pb = -((sx * sin) >> 14);
+		int16_t pc = (sy * sin) >> 14;
+		int16_t pd = (sy * cos) >> 14;
+		mem_set16(mem, dst + 0x0, pa);
+		mem_set16(mem, dst + 0x2, pb);
+		mem_set16(mem, dst + 0x4, pc);
+		mem_set16(mem, dst + 0x6, pd);
+		mem_set32(mem, dst + 0x8, ox - (pa * cx + pb * cy));
+		mem_set32(mem, dst + 0xC, oy - (pc * cx + pd * cy));
+		src += 0x14;
+		dst += 0x10;
+	}
+	return 4 + n * 77;
+}
+
+/* per entry: loads (9), sin and cos lookup (9), parameters (17), stores (10) and loop (4) */
+static uint32_t swi_objaffineset(cpu_t *cpu)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	uint32_t dst = cpu_get_reg(cpu, 1);
+	uint32_t n = cpu_get_reg(cpu, 2);
+	uint32_t off = cpu_get_reg(cpu, 3);
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		int16_t sx = mem_get16(mem, src + 0x0);
+		int16_t sy = mem_get16(mem, src + 0x2);
+		uint8_t theta = mem_get16(mem, src + 0x4) >> 8;
+		int32_t sin = sin_lut[theta];
+		int32_t cos = sin_lut[(uint8_t)(theta + 0x40)];
+		mem_set16(mem, dst + off * 0, (sx * cos) >> 14);
+		mem_set16(mem, dst + off * 1, -((sx * sin) >> 14));
+		mem_set16(mem, dst + off * 2, (sy * sin) >> 14);
+		mem_set16(mem, dst + off * 3, (sy * cos) >> 14);
+		src += 0x8;
+		dst += off * 4;
+	}
+	return 4 + n * 49;
+}
+
+/*
+ * header (8), flags byte (4), flag test (4) per token, ldrb (3) per
+ * literal, ldrb of both bytes and decoding (11) per match, loop (4) per
+ * copied byte, plus the output accesses
+ */
+static uint32_t swi_lz77(cpu_t *cpu, bool vram)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	bios_out_t out = {mem, cpu_get_reg(cpu, 1), 0, vram, 8};
+	if (!(src & 0x0E000000))
+		return 4;
+	uint32_t size = mem_get32(mem, src) >> 8;
+	uint32_t end = out.dst + size;
+	src += 4;
+	while (out.dst < end)
+	{
+		uint8_t flags = mem_get8(mem, src++);
+		out.cycles += 4;
+		for (uint8_t i = 0; i < 8 && out.dst < end; ++i)
+		{
+			out.cycles += 4;
+			if (!(flags & (0x80 >> i)))
+			{
+				out_put(&out, mem_get8(mem, src++));
+				out.cycles += 3;
+				continue;
+			}
+			uint8_t b0 = mem_get8(mem, src++);
+			uint8_t b1 = mem_get8(mem, src++);
+			uint32_t disp = (((b0 & 0xF) << 8) | b1) + 1;
+			uint32_t len = (b0 >> 4) + 3;
+			out.cycles += 11;
+			for (uint32_t j = 0; j < len && out.dst < end; ++j)
+			{
+				out_put(&out, out_get(&out, disp));
+				out.cycles += 4;
+			}
+		}
+	}
+	return out.cycles;
+}
+
+/*
+ * header (8), flags byte, test and length (8) per run, ldrb (3) per
+ * repeated value or literal byte, loop (4) per byte, plus the output
+ * accesses
+ */
+static uint32_t swi_rl(cpu_t *cpu, bool vram)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	bios_out_t out = {mem, cpu_get_reg(cpu, 1), 0, vram, 8};
+	if (!(src & 0x0E000000))
+		return 4;
+	uint32_t size = mem_get32(mem, src) >> 8;
+	uint32_t end = out.dst + size;
+	src += 4;
+	while (out.dst < end)
+	{
+		uint8_t flags = mem_get8(mem, src++);
+		out.cycles += 8;
+		if (flags & 0x80)
+		{
+			uint32_t len = (flags & 0x7F) + 3;
+			uint8_t v = mem_get8(mem, src++);
+			out.cycles += 3;
+			for (uint32_t i = 0; i < len && out.dst < end; ++i)
+			{
+				out_put(&out, v);
+				out.cycles += 4;
+			}
+		}
+		else
+		{
+			uint32_t len = (flags & 0x7F) + 1;
+			for (uint32_t i = 0; i < len && out.dst < end; ++i)
+			{
+				out_put(&out, mem_get8(mem, src++));
+				out.cycles += 7;
+			}
+		}
+	}
+	return out.cycles;
+}
+
+/*
+ * header and tree setup (12), ldr of each stream word (4), per bit
+ * the child offset, ldrb of the node and branch (11), per leaf the
+ * symbol merge and return to the root (8), str (4) of each output word
+ */
+static uint32_t swi_huff(cpu_t *cpu)
+{
+	mem_t *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0) & ~3;
+	uint32_t dst = cpu_get_reg(cpu, 1) & ~3;
+	if (!(src & 0x0E000000))
+		return 4;
+	uint32_t header = mem_get32(mem, src);
+	uint8_t bits = header & 0xF;
+	uint32_t size = header >> 8;
+	uint32_t end = dst + (size & ~3);
+	uint32_t root = src + 5;
+	uint32_t stream = src + 4 + (mem_get8(mem, src + 4) + 1) * 2;
+	uint32_t node = root;
+	uint8_t node_v = mem_get8(mem, node);
+	uint32_t word = 0;
+	uint8_t shift = 0;
+	uint32_t cycles = 12;
+	if (bits != 4 && bits != 8)
+		return cycles;
+	while (dst < end)
+	{
+		uint32_t data = mem_get32(mem, stream);
+		stream += 4;
+		cycles += 4;
+		for (int8_t i = 31; i >= 0 && dst < end; --i)
+		{
+			uint8_t right = (data >> i) & 1;
+			uint32_t child = (node & ~1) + (node_v & 0x3F) * 2 + 2 + right;
+			cycles += 11;
+			if (!(node_v & (right ? 0x40 : 0x80)))
+			{
+				node = child;
+				node_v = mem_get8(mem, node);
+				continue;
+			}
+			word |= (mem_get8(mem, child) & ((1 << bits) - 1)) << shift;
+			shift += bits;
+			cycles += 8;
+			node = root;
+			node_v = mem_get8(mem, node);
+			if (shift == 32)
+			{
+				mem_set32(mem, dst, word);
+				cycles += 4;
+				dst += 4;
+				word = 0;
+				shift = 0;
+			}
+		}
+	}
+	return cycles;
+}
+
+/* IME write (2), flags read, update and write back (8) and return (2) */
+static bool swi_intrwait(cpu_t *cpu, bool discard, uint16_t wanted)
+{
+	mem_t *mem = cpu->mem;
+	mem_set16(mem, 0x04000000 | MEM_REG_IME, 1);
+	uint16_t flags = mem_get16(mem, BIOS_IRQ_FLAGS);
+	if (discard && !cpu->bios_intrwait)
+		flags &= ~wanted;
+	if (flags & wanted)
+	{
+		mem_set16(mem, BIOS_IRQ_FLAGS, flags & ~wanted);
+		cpu->bios_intrwait = false;
+		return true;
+	}
+	mem_set16(mem, BIOS_IRQ_FLAGS, flags);
+	/* the swi is executed again when the interrupt handler returns */
+	cpu->bios_intrwait = true;
+	cpu->state = CPU_STATE_HALT;
+	return false;
+}
+
+bool bios_swi(cpu_t *cpu, uint8_t nn)
+{
+	uint32_t cycles;
+	switch (nn)
+	{
+		case 0x02:
+			/* mov, mov, strb to HALTCNT */
+			cpu->state = CPU_STATE_HALT;
+			cycles = 4;
+			break;
+		case 0x04:
+			if (!swi_intrwait(cpu, cpu_get_reg(cpu, 0), cpu_get_reg(cpu, 1)))
+				return true;
+			cycles = 12;
+			break;
+		case 0x05:
+			/* arguments of IntrWait (2) */
+			cpu_set_reg(cpu, 0, 1);
+			cpu_set_reg(cpu, 1, 1);
+			if (!swi_intrwait(cpu, true, 1))
+				return true;
+			cycles = 14;
+			break;
+		case 0x06:
+			cycles = swi_div(cpu, cpu_get_reg(cpu, 0), cpu_get_reg(cpu, 1));
+			break;
+		case 0x07:
+			cycles = swi_div(cpu, cpu_get_reg(cpu, 1), cpu_get_reg(cpu, 0));
+			break;
+		case 0x08:
+			cycles = swi_sqrt(cpu);
+			break;
+		case 0x09:
+			cycles = swi_arctan(cpu);
+			break;
+		case 0x0A:
+			cycles = swi_arctan2(cpu);
+			break;
+		case 0x0B:
+			cycles = swi_cpuset(cpu);
+			break;
+		case 0x0C:
+			cycles = swi_cpufastset(cpu);
+			break;
+		case 0x0E:
+			cycles = swi_bgaffineset(cpu);
+			break;
+		case 0x0F:
+			cycles = swi_objaffineset(cpu);
+			break;
+		case 0x11:
+			cycles = swi_lz77(cpu, false);
+			break;
+		case 0x12:
+			cycles = swi_lz77(cpu, true);
+			break;
+		case 0x13:
+			cycles = swi_huff(cpu);
+			break;
+		case 0x14:
+			cycles = swi_rl(cpu, false);
+			break;
+		case 0x15:
+			cycles = swi_rl(cpu, true);
+			break;
+		default:
+			return false;
+	}
+	cpu->instr_delay = SWI_CYCLES + cycles;
+	cpu_inc_pc(cpu, CPU_GET_FLAG_T(cpu) ? 2 : 4);
+	return true;
+}
@@ -0,0 +1,11 @@
+#ifndef BIOS_H
+#define BIOS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct cpu_s cpu_t;
+
+bool bios_swi(cpu_t *cpu, uint8_t nn);
+
+#endif
@@ -1,20 +1,50 @@
+#include "profile.h"
+#include "trace.h"
 #include "cpu.h"
+#include "gba.h"
 #include "mem.h"
 #include "cpu/instr.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 
+static pthread_once_t g_instr_tables_once = PTHREAD_ONCE_INIT;
+
+static void init_instr_tables(void);
+static void update_instr_tables(cpu_t *cpu);
+
+void cpu_init(cpu_t *cpu, mem_t *mem)
+{
+	cpu->mem = mem;
+	cpu->regs.cpsr = 0xD3;
+	cpu_update_mode(cpu);
+	pthread_once(&g_instr_tables_once, init_instr_tables);
+	update_instr_tables(cpu);
+}
+
+void cpu_destroy(cpu_t *cpu)
+{
+	profile_del(cpu->profile);
+	trace_del(cpu->trace);
+}
+
+void cpu_rebase(cpu_t *cpu, ptrdiff_t delta)
+{
+	MEM_REBASE(cpu->mem, delta);
+	for (size_t i = 0; i < 16; ++i)
+		MEM_REBASE(cpu->regs.rptr[i], delta);
+	MEM_REBASE(cpu->regs.spsr, delta);
+}
+
 cpu_t *cpu_new(mem_t *mem)
 {
 	cpu_t *cpu = calloc(sizeof(*cpu), 1);
 	if (!cpu)
 		return NULL;
 
-	cpu->mem = mem;
-	cpu->regs.cpsr = 0xD3;
-	cpu_update_mode(cpu);
+	cpu_init(cpu, mem);
 	return cpu;
 }
 
@@ -22,48 +52,34 @@ void cpu_del(cpu_t *cpu)
 {
 	if (!cpu)
 		return;
+	cpu_destroy(cpu);
 	free(cpu);
 }
 
-static bool check_arm_cond(cpu_t *cpu, uint32_t cond)
+/* bit n of cond_lut[cond] is set when cond passes with NZCV == n */
+static const uint16_t cond_lut[16] =
 {
-	switch (cond & 0xF)
-	{
-		case 0x0:
-			return CPU_GET_FLAG_Z(cpu);
-		case 0x1:
-			return !CPU_GET_FLAG_Z(cpu);
-		case 0x2:
-			return CPU_GET_FLAG_C(cpu);
-		case 0x3:
-			return !CPU_GET_FLAG_C(cpu);
-		case 0x4:
-			return CPU_GET_FLAG_N(cpu);
-		case 0x5:
-			return !CPU_GET_FLAG_N(cpu);
-		case 0x6:
-			return CPU_GET_FLAG_V(cpu);
-		case 0x7:
-			return !CPU_GET_FLAG_V(cpu);
-		case 0x8:
-			return CPU_GET_FLAG_C(cpu) && !CPU_GET_FLAG_Z(cpu);
-		case 0x9:
-			return !CPU_GET_FLAG_C(cpu) || CPU_GET_FLAG_Z(cpu);
-		case 0xA:
-			return CPU_GET_FLAG_N(cpu) == CPU_GET_FLAG_V(cpu);
-		case 0xB:
-			return CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(cpu);
-		case 0xC:
-			return !CPU_GET_FLAG_Z(cpu) && CPU_GET_FLAG_N(cpu) == CPU_GET_FLAG_V(cpu);
-		case 0xD:
-			return CPU_GET_FLAG_Z(cpu) || CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(cpu);
-		case 0xE:
-			return true;
-		case 0xF:
-			return false;
-	}
-	/* unreachable */
-	return false;
+	0xF0F0, /* EQ */
+	0x0F0F, /* NE */
+	0xCCCC, /* CS */
+	0x3333, /* CC */
+	0xFF00, /* MI */
+	0x00FF, /* PL */
+	0xAAAA, /* VS */
+	0x5555, /* VC */
+	0x0C0C, /* HI */
+	0xF3F3, /* LS */
+	0xAA55, /* GE */
+	0x55AA, /* LT */
+	0x0A05, /* GT */
+	0xF5FA, /* LE */
+	0xFFFF, /* AL */
+	0x0000, /* NV */
+};
+
+static inline bool check_arm_cond(cpu_t *cpu, uint32_t cond)
+{
+	return (cond_lut[cond & 0xF] >> (cpu->regs.cpsr >> 28)) & 1;
 }
 
 static void print_instr(cpu_t *cpu, const char *msg, const cpu_instr_t *instr)
@@ -138,37 +154,185 @@ static void print_instr(cpu_t *cpu, const char *msg, const cpu_instr_t *instr)
 
 static bool handle_interrupt(cpu_t *cpu)
 {
-	if (CPU_GET_FLAG_I(cpu))
+	if (cpu->state == CPU_STATE_FUSED)
 		return false;
-	uint16_t reg_if = mem_get_reg16(cpu->mem, MEM_REG_IF);
-	if (!reg_if)
-		return false;
-	uint16_t reg_ie = mem_get_reg16(cpu->mem, MEM_REG_IE);
-	uint16_t ints = reg_ie & reg_if;
-	if (!ints)
+	if (!cpu->irq_pending || CPU_GET_FLAG_I(cpu))
 		return false;
 	cpu->state = CPU_STATE_RUN;
-	uint16_t ime = mem_get_reg16(cpu->mem, MEM_REG_IME);
-	if (!ime)
+	if (!cpu->irq_line)
 		return false;
-	for (uint8_t i = 0; i < 16; ++i)
+	cpu->regs.spsr_modes[3] = cpu->regs.cpsr;
+	CPU_SET_MODE(cpu, CPU_MODE_IRQ);
+	CPU_SET_FLAG_I(cpu, 1);
+	cpu_update_mode(cpu);
+	if (CPU_GET_FLAG_T(cpu))
 	{
-		if (!(ints & (1 << i)))
-			continue;
-		cpu->regs.spsr_modes[3] = cpu->regs.cpsr;
-		CPU_SET_MODE(cpu, CPU_MODE_IRQ);
-		cpu_update_mode(cpu);
-		CPU_SET_FLAG_I(cpu, 1);
-		if (CPU_GET_FLAG_T(cpu))
-		{
-			CPU_SET_FLAG_T(cpu, 0);
-			cpu_set_reg(cpu, CPU_REG_LR, cpu_get_reg(cpu, CPU_REG_PC) + 4);
-		}
-		else
+		CPU_SET_FLAG_T(cpu, 0);
+		cpu_set_reg(cpu, CPU_REG_LR, cpu_get_reg(cpu, CPU_REG_PC) + 4);
+	}
+	else
+	{
+		cpu_set_reg(cpu, CPU_REG_LR, cpu_get_reg(cpu, CPU_REG_PC) + 4);
+	}
+	cpu_set_reg(cpu, CPU_REG_PC, 0x18);
+	return true;
+}
+
+/*
+ * when tracing, profiling or breaking, every entry of the active dispatch
+ * tables points to a hook wrapping the real instruction, so the normal
+ * path doesn't have to test for instrumentation. the tables are shared by
+ * all the instances and built once, each cpu only picks its tables
+ */
+static const cpu_instr_t *instr_thumb_hooked[0x400];
+static const cpu_instr_t *instr_arm_hooked[0x1000];
+static const cpu_instr_t *instr_thumb_fused[0x400];
+
+static void check_breakpoints(cpu_t *cpu)
+{
+	uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC);
+	for (size_t i = 0; i < cpu->breakpoints_nb; ++i)
+	{
+		if (cpu->breakpoints[i] == pc)
 		{
-			cpu_set_reg(cpu, CPU_REG_LR, cpu_get_reg(cpu, CPU_REG_PC) + 4);
+			gba_break(cpu->mem->gba, GBA_BREAK_EXEC, pc);
+			return;
 		}
-		cpu_set_reg(cpu, CPU_REG_PC, 0x18);
+	}
+}
+
+static void exec_hooks(cpu_t *cpu, const cpu_instr_t *instr)
+{
+	if (cpu->breakpoints_nb)
+		check_breakpoints(cpu);
+	if (cpu->debug)
+		print_instr(cpu, "EXEC", instr);
+	if (cpu->trace)
+		trace_add(cpu->trace, cpu, 0, cpu->mem->gba->cycle);
+	if (!cpu->profile)
+	{
+		instr->exec(cpu);
+		return;
+	}
+	uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC);
+	bool thumb = CPU_GET_FLAG_T(cpu);
+	uint32_t opcode = cpu->instr_opcode;
+	instr->exec(cpu);
+	/* charge the fetch and data waitstates to the instruction that made them */
+	cpu->instr_delay += mem_take_waits(cpu->mem);
+	profile_add(cpu->profile, pc, thumb, opcode, instr, cpu->instr_delay + 1);
+}
+
+static void exec_thumb_hooked(cpu_t *cpu)
+{
+	exec_hooks(cpu, cpu_instr_thumb[cpu->instr_opcode >> 6]);
+}
+
+static void print_thumb_hooked(cpu_t *cpu, char *data, size_t size)
+{
+	const cpu_instr_t *instr = cpu_instr_thumb[cpu->instr_opcode >> 6];
+	if (instr->print)
+		instr->print(cpu, data, size);
+}
+
+static const cpu_instr_t thumb_hooked =
+{
+	.exec = exec_thumb_hooked,
+	.print = print_thumb_hooked,
+};
+
+static void exec_arm_hooked(cpu_t *cpu)
+{
+	exec_hooks(cpu, cpu_instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)]);
+}
+
+static void print_arm_hooked(cpu_t *cpu, char *data, size_t size)
+{
+	const cpu_instr_t *instr = cpu_instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)];
+	if (instr->print)
+		instr->print(cpu, data, size);
+}
+
+static const cpu_instr_t arm_hooked =
+{
+	.exec = exec_arm_hooked,
+	.print = print_arm_hooked,
+};
+
+static void skip_hooked(cpu_t *cpu, uint32_t waits)
+{
+	const cpu_instr_t *instr = cpu_instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)];
+	if (cpu->breakpoints_nb)
+		check_breakpoints(cpu);
+	if (cpu->debug)
+		print_instr(cpu, "SKIP", instr);
+	if (cpu->trace)
+		trace_add(cpu->trace, cpu, TRACE_SKIPPED, cpu->mem->gba->cycle);
+	if (cpu->profile)
+		profile_add(cpu->profile, cpu_get_reg(cpu, CPU_REG_PC), false, cpu->instr_opcode, instr, waits + 1);
+}
+
+static void init_instr_tables(void)
+{
+	cpu_instr_thumb_fuse(instr_thumb_fused);
+	for (size_t i = 0; i < 0x400; ++i)
+		instr_thumb_hooked[i] = &thumb_hooked;
+	for (size_t i = 0; i < 0x1000; ++i)
+		instr_arm_hooked[i] = &arm_hooked;
+}
+
+static void update_instr_tables(cpu_t *cpu)
+{
+	if (!cpu->debug && !cpu->profile && !cpu->trace && !cpu->breakpoints_nb)
+	{
+		cpu->instr_thumb = instr_thumb_fused;
+		cpu->instr_arm = cpu_instr_arm;
+		return;
+	}
+	cpu->instr_thumb = instr_thumb_hooked;
+	cpu->instr_arm = instr_arm_hooked;
+}
+
+void cpu_set_debug(cpu_t *cpu, uint8_t debug)
+{
+	cpu->debug = debug;
+	update_instr_tables(cpu);
+}
+
+void cpu_set_profile(cpu_t *cpu, profile_t *profile)
+{
+	cpu->profile = profile;
+	update_instr_tables(cpu);
+}
+
+void cpu_set_trace(cpu_t *cpu, trace_t *trace)
+{
+	cpu->trace = trace;
+	update_instr_tables(cpu);
+}
+
+bool cpu_add_breakpoint(cpu_t *cpu, uint32_t addr)
+{
+	for (size_t i = 0; i < cpu->breakpoints_nb; ++i)
+	{
+		if (cpu->breakpoints[i] == addr)
+			return true;
+	}
+	if (cpu->breakpoints_nb == CPU_BREAKPOINTS_MAX)
+		return false;
+	cpu->breakpoints[cpu->breakpoints_nb++] = addr;
+	update_instr_tables(cpu);
+	return true;
+}
+
+bool cpu_del_breakpoint(cpu_t *cpu, uint32_t addr)
+{
+	for (size_t i = 0; i < cpu->breakpoints_nb; ++i)
+	{
+		if (cpu->breakpoints[i] != addr)
+			continue;
+		cpu->breakpoints[i] = cpu->breakpoints[--cpu->breakpoints_nb];
+		update_instr_tables(cpu);
 		return true;
 	}
 	return false;
@@ -181,35 +345,55 @@ static bool decode_instruction(cpu_t *cpu)
 		uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC);
 		if (pc < 0x4000)
 			cpu->last_bios_decode = pc + 4;
-		cpu->instr_opcode = mem_get16(cpu->mem, pc);
-		cpu->instr = cpu_instr_thumb[cpu->instr_opcode >> 6];
+		cpu->instr_opcode = mem_fetch16(cpu->mem, pc);
+		cpu->instr = cpu->instr_thumb[cpu->instr_opcode >> 6];
 	}
 	else
 	{
 		uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC);
 		if (pc < 0x4000)
 			cpu->last_bios_decode = pc + 8;
-		cpu->instr_opcode = mem_get32(cpu->mem, pc);
-		if (!check_arm_cond(cpu, cpu->instr_opcode >> 28))
+		cpu->instr_opcode = mem_fetch32(cpu->mem, pc);
+		if ((cpu->instr_opcode >> 28) != 0xE && !check_arm_cond(cpu, cpu->instr_opcode >> 28))
 		{
-			if (cpu->debug)
-				print_instr(cpu, "SKIP", cpu_instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)]);
+			/* a skipped instruction still pays for its fetch */
+			uint32_t waits = mem_take_waits(cpu->mem);
+			if (cpu->instr_arm != cpu_instr_arm)
+				skip_hooked(cpu, waits);
+			cpu->instr_delay += waits;
 			cpu_inc_pc(cpu, 4);
 			cpu->instr = NULL;
 			return false;
 		}
-		cpu->instr = cpu_instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)];
+		cpu->instr = cpu->instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)];
 	}
 
 	return true;
 }
 
+/*
+ * the cycle the second half of a fused thumb pair would have executed on:
+ * sample the irq line as the unfused pair would have, then wait out the
+ * second instruction delay
+ */
+static void exec_fused_tail(cpu_t *cpu)
+{
+	cpu->state = CPU_STATE_RUN;
+	cpu->instr_delay = cpu->instr_fused_delay;
+	if (cpu->irq_line && handle_interrupt(cpu))
+	{
+		/* the next instruction fetch wouldn't have happened */
+		cpu->mem->wait_cycles = 0;
+		(void)decode_instruction(cpu);
+	}
+}
+
 void cpu_cycle(cpu_t *cpu)
 {
 	//if (cpu_get_reg(cpu, CPU_REG_PC) >= 0x4000)
-	//	cpu->debug = CPU_DEBUG_REGS | CPU_DEBUG_INSTR;
+	//	cpu_set_debug(cpu, CPU_DEBUG_REGS | CPU_DEBUG_INSTR);
 	//if (cpu_get_reg(cpu, CPU_REG_PC) == 0x872)
-	//	cpu->debug = 0;
+	//	cpu_set_debug(cpu, 0);
 
 	if (cpu->instr_delay)
 	{
@@ -225,17 +409,22 @@ void cpu_cycle(cpu_t *cpu)
 
 	if (cpu->state != CPU_STATE_RUN)
 	{
+		if (cpu->state == CPU_STATE_FUSED)
+		{
+			exec_fused_tail(cpu);
+			return;
+		}
 		if (!handle_interrupt(cpu))
 			return;
 		if (!decode_instruction(cpu))
 			return;
 	}
 
-	if (cpu->debug)
-		print_instr(cpu, "EXEC", cpu->instr);
 	cpu->instr->exec(cpu);
+	cpu->instr_delay += mem_take_waits(cpu->mem);
 
-	(void)handle_interrupt(cpu);
+	if (cpu->irq_line || cpu->state != CPU_STATE_RUN)
+		(void)handle_interrupt(cpu);
 	(void)decode_instruction(cpu);
 }
 
@@ -278,4 +467,5 @@ void cpu_update_mode(cpu_t *cpu)
 			printf("unknown mode: %x\n", CPU_GET_MODE(cpu));
 			assert(!"invalid mode");
 	}
+	cpu_update_irq(cpu);
 }
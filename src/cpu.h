@@ -1,11 +1,14 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 typedef struct cpu_instr_s cpu_instr_t;
 typedef struct mem_s mem_t;
+typedef struct profile_s profile_t;
+typedef struct trace_s trace_t;
 
 #define CPU_DEBUG_BASE    (1 << 0) /* print instr name */
 #define CPU_DEBUG_INSTR   (1 << 1) /* print disassembled instruction */
@@ -13,6 +16,8 @@ typedef struct mem_s mem_t;
 #define CPU_DEBUG_REGS_ML (1 << 3) /* multiline registers dump */
 #define CPU_DEBUG_ALL     (CPU_DEBUG_BASE | CPU_DEBUG_INSTR | CPU_DEBUG_REGS)
 
+#define CPU_BREAKPOINTS_MAX 16
+
 #define CPU_FLAG_N (1 << 31)
 #define CPU_FLAG_Z (1 << 30)
 #define CPU_FLAG_C (1 << 29)
@@ -83,6 +88,7 @@ enum cpu_state
 	CPU_STATE_RUN,
 	CPU_STATE_HALT,
 	CPU_STATE_STOP,
+	CPU_STATE_FUSED, /* second half of a fused pair already executed, its cycle is pending */
 };
 
 typedef struct cpu_s
@@ -93,15 +99,40 @@ typedef struct cpu_s
 	uint32_t last_bios_decode;
 	uint32_t instr_opcode;
 	uint32_t instr_delay;
+	uint32_t instr_fused_delay;
 	uint8_t debug;
 	enum cpu_state state;
+	bool irq_pending; /* IE & IF */
+	bool irq_master; /* IME */
+	bool irq_line; /* irq_pending && irq_master && !CPSR.I */
+	bool bios_hle;
+	bool bios_intrwait;
+	profile_t *profile;
+	trace_t *trace;
+	uint32_t breakpoints[CPU_BREAKPOINTS_MAX];
+	uint8_t breakpoints_nb;
+	const cpu_instr_t **instr_thumb;
+	const cpu_instr_t **instr_arm;
 } cpu_t;
 
+void cpu_init(cpu_t *cpu, mem_t *mem);
+void cpu_destroy(cpu_t *cpu);
+void cpu_rebase(cpu_t *cpu, ptrdiff_t delta);
 cpu_t *cpu_new(mem_t *mem);
 void cpu_del(cpu_t *cpu);
 
 void cpu_cycle(cpu_t *cpu);
 void cpu_update_mode(cpu_t *cpu);
+void cpu_set_debug(cpu_t *cpu, uint8_t debug);
+void cpu_set_profile(cpu_t *cpu, profile_t *profile);
+void cpu_set_trace(cpu_t *cpu, trace_t *trace);
+bool cpu_add_breakpoint(cpu_t *cpu, uint32_t addr);
+bool cpu_del_breakpoint(cpu_t *cpu, uint32_t addr);
+
+static inline void cpu_update_irq(cpu_t *cpu)
+{
+	cpu->irq_line = cpu->irq_pending && cpu->irq_master && !CPU_GET_FLAG_I(cpu);
+}
 
 static inline uint32_t cpu_get_reg(cpu_t *cpu, uint32_t reg)
 {
@@ -1,5 +1,6 @@
 #include "instr.h"
 #include "../cpu.h"
+#include "../bios.h"
 #include "../mem.h"
 
 #include <stdlib.h>
@@ -918,6 +919,15 @@ static void exec_##opname####oparg(cpu_t *cpu) \
 	{ \
 		new_base = old_base + nregs * 4; \
 	} \
+	uint32_t block_addr = rn + (post_pre == down_up ? 4 : 0); \
+	uint8_t *block = NULL; \
+	if (rl) \
+	{ \
+		if (st_ld) \
+			block = mem_get_block(cpu->mem, block_addr & ~3, nregs * 4); \
+		else \
+			block = mem_set_block(cpu->mem, block_addr & ~3, nregs * 4); \
+	} \
 	bool nowriteback = false; \
 	if (rl) \
 	{ \
@@ -930,7 +940,11 @@ static void exec_##opname####oparg(cpu_t *cpu) \
 				rn += 4; \
 			if (st_ld) \
 			{ \
-				uint32_t v = mem_get32(cpu->mem, rn); \
+				uint32_t v; \
+				if (block) \
+					v = *(uint32_t*)&block[rn - block_addr]; \
+				else \
+					v = mem_get32(cpu->mem, rn); \
 				if (i == CPU_REG_PC) \
 				{ \
 					pc_inc = false; \
@@ -982,7 +996,10 @@ static void exec_##opname####oparg(cpu_t *cpu) \
 				} \
 				if (i == CPU_REG_PC) \
 					v += 12; \
-				mem_set32(cpu->mem, rn, v); \
+				if (block) \
+					*(uint32_t*)&block[rn - block_addr] = v; \
+				else \
+					mem_set32(cpu->mem, rn, v); \
 			} \
 			if (post_pre != down_up) \
 				rn += 4; \
@@ -1507,10 +1524,12 @@ static const cpu_instr_t arm_mrc =
 
 static void exec_swi(cpu_t *cpu)
 {
+	if (cpu->bios_hle && bios_swi(cpu, (cpu->instr_opcode >> 16) & 0xFF))
+		return;
 	cpu->regs.spsr_modes[1] = cpu->regs.cpsr;
 	CPU_SET_MODE(cpu, CPU_MODE_SVC);
-	cpu_update_mode(cpu);
 	CPU_SET_FLAG_I(cpu, 1);
+	cpu_update_mode(cpu);
 	cpu_set_reg(cpu, CPU_REG_LR, cpu_get_reg(cpu, CPU_REG_PC) + 4);
 	cpu_set_reg(cpu, CPU_REG_PC, 0x8);
 }
@@ -15,4 +15,6 @@ typedef struct cpu_instr_s
 extern const cpu_instr_t *cpu_instr_thumb[0x400];
 extern const cpu_instr_t *cpu_instr_arm[0x1000];
 
+void cpu_instr_thumb_fuse(const cpu_instr_t **instr);
+
 #endif
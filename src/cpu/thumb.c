@@ -1,5 +1,6 @@
 #include "instr.h"
 #include "../cpu.h"
+#include "../bios.h"
 #include "../mem.h"
 
 #include <stdint.h>
@@ -778,6 +779,15 @@ static void exec_##n####next(cpu_t *cpu) \
 	{ \
 		new_base = old_base + nregs * 4; \
 	} \
+	uint32_t block_addr = sp + (post_pre == down_up ? 4 : 0); \
+	uint8_t *block = NULL; \
+	if (rl || ext_reg) \
+	{ \
+		if (st_ld) \
+			block = mem_get_block(cpu->mem, block_addr & ~3, nregs * 4); \
+		else \
+			block = mem_set_block(cpu->mem, block_addr & ~3, nregs * 4); \
+	} \
 	bool nowriteback = false; \
 	if (rl) \
 	{ \
@@ -792,7 +802,11 @@ static void exec_##n####next(cpu_t *cpu) \
 			{ \
 				if (i == base_reg) \
 					nowriteback = true; \
-				uint32_t v = mem_get32(cpu->mem, sp); \
+				uint32_t v; \
+				if (block) \
+					v = *(uint32_t*)&block[sp - block_addr]; \
+				else \
+					v = mem_get32(cpu->mem, sp); \
 				if (i == CPU_REG_PC) \
 				{ \
 					pc_inc = false; \
@@ -816,7 +830,10 @@ static void exec_##n####next(cpu_t *cpu) \
 				} \
 				if (i == CPU_REG_PC) \
 					v += 6; \
-				mem_set32(cpu->mem, sp, v); \
+				if (block) \
+					*(uint32_t*)&block[sp - block_addr] = v; \
+				else \
+					mem_set32(cpu->mem, sp, v); \
 			} \
 			if (post_pre != down_up) \
 				sp += 4; \
@@ -830,12 +847,20 @@ static void exec_##n####next(cpu_t *cpu) \
 			sp += 4; \
 		if (st_ld) \
 		{ \
-			cpu_set_reg(cpu, CPU_REG_PC, mem_get32(cpu->mem, sp) & ~1); \
+			uint32_t v; \
+			if (block) \
+				v = *(uint32_t*)&block[sp - block_addr]; \
+			else \
+				v = mem_get32(cpu->mem, sp); \
+			cpu_set_reg(cpu, CPU_REG_PC, v & ~1); \
 			pc_inc = false; \
 		} \
 		else \
 		{ \
-			mem_set32(cpu->mem, sp, cpu_get_reg(cpu, CPU_REG_LR)); \
+			if (block) \
+				*(uint32_t*)&block[sp - block_addr] = cpu_get_reg(cpu, CPU_REG_LR); \
+			else \
+				mem_set32(cpu->mem, sp, cpu_get_reg(cpu, CPU_REG_LR)); \
 		} \
 		if (post_pre != down_up) \
 			sp += 4; \
@@ -1004,10 +1029,12 @@ THUMB_BRANCH(ble, CPU_GET_FLAG_Z(cpu) || CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(c
 
 static void exec_swi(cpu_t *cpu)
 {
+	if (cpu->bios_hle && bios_swi(cpu, cpu->instr_opcode & 0xFF))
+		return;
 	cpu->regs.spsr_modes[1] = cpu->regs.cpsr;
 	CPU_SET_MODE(cpu, CPU_MODE_SVC);
-	cpu_update_mode(cpu);
 	CPU_SET_FLAG_I(cpu, 1);
+	cpu_update_mode(cpu);
 	CPU_SET_FLAG_T(cpu, 0);
 	cpu_set_reg(cpu, CPU_REG_LR, cpu_get_reg(cpu, CPU_REG_PC) + 2);
 	cpu_set_reg(cpu, CPU_REG_PC, 0x8);
@@ -1308,3 +1335,68 @@ const cpu_instr_t *cpu_instr_thumb[0x400] =
 	/* 0x3C0 */ REPEAT32(bl_setup),
 	/* 0x3E0 */ REPEAT32(bl_off),
 };
+
+/*
+ * superinstructions: the first half of a common pair also runs the second
+ * one when it follows, in a single dispatch. the pair keeps the delays of
+ * both halves and leaves the cpu in CPU_STATE_FUSED so the cycle of the
+ * second half still samples interrupts, as the unfused execution does
+ */
+#define THUMB_FUSED(n, second) \
+static void exec_fused_##n(cpu_t *cpu) \
+{ \
+	cpu_instr_thumb[cpu->instr_opcode >> 6]->exec(cpu); \
+	uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC); \
+	if (cpu->irq_line || pc < 0x4000) \
+		return; \
+	uint32_t delay = cpu->instr_delay + mem_take_waits(cpu->mem); \
+	uint32_t fetch_next = cpu->mem->fetch_next; \
+	uint16_t next = mem_fetch16(cpu->mem, pc); \
+	if (!(second)) \
+	{ \
+		/* leave the fetch to the normal decode */ \
+		cpu->mem->fetch_next = fetch_next; \
+		cpu->mem->wait_cycles = 0; \
+		cpu->instr_delay = delay; \
+		return; \
+	} \
+	cpu->instr_delay = 0; \
+	cpu->instr_opcode = next; \
+	cpu_instr_thumb[next >> 6]->exec(cpu); \
+	cpu->instr_fused_delay = cpu->instr_delay + mem_take_waits(cpu->mem); \
+	cpu->instr_delay = delay; \
+	cpu->state = CPU_STATE_FUSED; \
+} \
+static void print_fused_##n(cpu_t *cpu, char *data, size_t size) \
+{ \
+	cpu_instr_thumb[cpu->instr_opcode >> 6]->print(cpu, data, size); \
+} \
+static const cpu_instr_t thumb_fused_##n = \
+{ \
+	.exec = exec_fused_##n, \
+	.print = print_fused_##n, \
+}
+
+THUMB_FUSED(cmp_bcond  , (next & 0xF000) == 0xD000 && (next & 0x0F00) < 0x0E00);
+THUMB_FUSED(bl         , (next & 0xF800) == 0xF800);
+THUMB_FUSED(ldrpc_bx   , (next & 0xFF87) == 0x4700 && (cpu_get_reg(cpu, (next >> 3) & 0xF) & 1)); /* staying in thumb */
+THUMB_FUSED(push_addsp , (next & 0xFF00) == 0xB000);
+THUMB_FUSED(addsp_pop  , (next & 0xFE00) == 0xBC00);
+
+static void set_fused(const cpu_instr_t **instr, uint32_t first, uint32_t last, const cpu_instr_t *fused)
+{
+	for (uint32_t i = first; i <= last; ++i)
+		instr[i] = fused;
+}
+
+void cpu_instr_thumb_fuse(const cpu_instr_t **instr)
+{
+	memcpy(instr, cpu_instr_thumb, sizeof(cpu_instr_thumb));
+	set_fused(instr, 0x0A0, 0x0BF, &thumb_fused_cmp_bcond); /* cmp rd, #nn */
+	set_fused(instr, 0x10A, 0x10A, &thumb_fused_cmp_bcond); /* cmp rd, rs */
+	set_fused(instr, 0x114, 0x117, &thumb_fused_cmp_bcond); /* cmp rd, hs */
+	set_fused(instr, 0x120, 0x13F, &thumb_fused_ldrpc_bx);
+	set_fused(instr, 0x2C0, 0x2C3, &thumb_fused_addsp_pop);
+	set_fused(instr, 0x2D0, 0x2D7, &thumb_fused_push_addsp);
+	set_fused(instr, 0x3C0, 0x3DF, &thumb_fused_bl);
+}
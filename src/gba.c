@@ -1,3 +1,5 @@
+#include "profile.h"
+#include "trace.h"
 #include "gba.h"
 #include "mbc.h"
 #include "mem.h"
@@ -9,45 +11,89 @@
 #include <string.h>
 #include <stdio.h>
 
-gba_t *gba_new(const void *rom_data, size_t rom_size)
+/*
+ * an instance is a single allocation: the components, the ones used on
+ * every instruction first, then the memories, the gpu buffers and the rom
+ * on their own pages. the pointers all lead inside the arena, so a copy of
+ * it is a whole instance once rebased
+ */
+typedef struct gba_arena_s
 {
-	gba_t *gba = calloc(sizeof(*gba), 1);
-	if (!gba)
-		return NULL;
+	gba_t gba;
+	cpu_t cpu;
+	mem_t mem;
+	apu_t apu;
+	gpu_t gpu;
+	mbc_t mbc;
+} gba_arena_t;
 
-	gba->mbc = mbc_new(rom_data, rom_size);
-	if (!gba->mbc)
-		return NULL;
+#define ARENA_RAM_OFFSET MEM_PAGE_ALIGN(sizeof(gba_arena_t))
+#define ARENA_GPU_OFFSET (ARENA_RAM_OFFSET + MEM_RAM_SIZE)
+#define ARENA_ROM_OFFSET (ARENA_GPU_OFFSET + GPU_RAM_SIZE)
 
-	gba->mem = mem_new(gba, gba->mbc);
-	if (!gba->mem)
+gba_t *gba_new(const void *rom_data, size_t rom_size)
+{
+	uint8_t *arena = calloc(MEM_PAGE_SIZE + ARENA_ROM_OFFSET + rom_size, 1);
+	if (!arena)
 		return NULL;
 
-	gba->apu = apu_new(gba->mem);
-	if (!gba->apu)
-		return NULL;
+	uint8_t *data = (uint8_t*)MEM_PAGE_ALIGN((uintptr_t)arena);
+	gba_arena_t *components = (gba_arena_t*)data;
+	gba_t *gba = &components->gba;
+	gba->arena = arena;
+	gba->mbc = &components->mbc;
+	gba->mem = &components->mem;
+	gba->apu = &components->apu;
+	gba->cpu = &components->cpu;
+	gba->gpu = &components->gpu;
 
-	gba->cpu = cpu_new(gba->mem);
-	if (!gba->cpu)
+	mbc_init(gba->mbc, rom_data, rom_size, &data[ARENA_ROM_OFFSET]);
+	if (!mem_init(gba->mem, gba, gba->mbc, &data[ARENA_RAM_OFFSET]))
+	{
+		free(arena);
 		return NULL;
+	}
+	apu_init(gba->apu, gba->mem);
+	cpu_init(gba->cpu, gba->mem);
+	gpu_init(gba->gpu, gba->mem, &data[ARENA_GPU_OFFSET]);
+	return gba;
+}
 
-	gba->gpu = gpu_new(gba->mem);
-	if (!gba->gpu)
+/* the profile, the trace and the render thread stay with the original */
+gba_t *gba_clone(gba_t *gba)
+{
+	size_t size = ARENA_ROM_OFFSET + gba->mbc->data_size;
+	uint8_t *arena = malloc(MEM_PAGE_SIZE + size);
+	if (!arena)
 		return NULL;
 
-	return gba;
+	uint8_t *data = (uint8_t*)MEM_PAGE_ALIGN((uintptr_t)arena);
+	memcpy(data, gba, size);
+	ptrdiff_t delta = (uintptr_t)data - (uintptr_t)gba;
+	gba_t *clone = (gba_t*)data;
+	clone->arena = arena;
+	MEM_REBASE(clone->mbc, delta);
+	MEM_REBASE(clone->mem, delta);
+	MEM_REBASE(clone->apu, delta);
+	MEM_REBASE(clone->cpu, delta);
+	MEM_REBASE(clone->gpu, delta);
+	mbc_rebase(clone->mbc, delta);
+	mem_rebase(clone->mem, delta);
+	apu_rebase(clone->apu, delta);
+	cpu_rebase(clone->cpu, delta);
+	gpu_rebase(clone->gpu, delta);
+	cpu_set_profile(clone->cpu, NULL);
+	cpu_set_trace(clone->cpu, NULL);
+	return clone;
 }
 
 void gba_del(gba_t *gba)
 {
 	if (!gba)
 		return;
-	mbc_del(gba->mbc);
-	mem_del(gba->mem);
-	apu_del(gba->apu);
-	cpu_del(gba->cpu);
-	gpu_del(gba->gpu);
-	free(gba);
+	gpu_destroy(gba->gpu);
+	cpu_destroy(gba->cpu);
+	free(gba->arena);
 }
 
 static void gba_cycle(gba_t *gba)
@@ -70,7 +116,7 @@ void gba_frame(gba_t *gba, uint8_t *video_buf, int16_t *audio_buf, uint32_t joyp
 		mem_set_reg16(gba->mem, MEM_REG_VCOUNT, y);
 
 		if ((mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & (1 << 5)) && y == ((mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) >> 8) & 0xFF))
-			mem_set_reg16(gba->mem, MEM_REG_IF, mem_get_reg16(gba->mem, MEM_REG_IF) | (1 << 2));
+			mem_raise_irq(gba->mem, (1 << 2));
 
 		/* draw */
 		gpu_draw(gba->gpu, y);
@@ -80,7 +126,7 @@ void gba_frame(gba_t *gba, uint8_t *video_buf, int16_t *audio_buf, uint32_t joyp
 		/* hblank */
 		mem_set_reg16(gba->mem, MEM_REG_DISPSTAT, (mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & 0xFFFC) | 0x2);
 		if (mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & (1 << 4))
-			mem_set_reg16(gba->mem, MEM_REG_IF, mem_get_reg16(gba->mem, MEM_REG_IF) | (1 << 1));
+			mem_raise_irq(gba->mem, (1 << 1));
 		mem_hblank(gba->mem);
 
 		for (size_t i = 0; i < 272; ++i)
@@ -89,7 +135,7 @@ void gba_frame(gba_t *gba, uint8_t *video_buf, int16_t *audio_buf, uint32_t joyp
 
 	gpu_commit_bgpos(gba->gpu);
 	if (mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & (1 << 3))
-		mem_set_reg16(gba->mem, MEM_REG_IF, mem_get_reg16(gba->mem, MEM_REG_IF) | (1 << 0));
+		mem_raise_irq(gba->mem, (1 << 0));
 	mem_vblank(gba->mem);
 
 	for (uint8_t y = 160; y < 228; ++y)
@@ -98,7 +144,7 @@ void gba_frame(gba_t *gba, uint8_t *video_buf, int16_t *audio_buf, uint32_t joyp
 		mem_set_reg16(gba->mem, MEM_REG_VCOUNT, y);
 
 		if ((mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & (1 << 5)) && y == ((mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) >> 8) & 0xFF))
-			mem_set_reg16(gba->mem, MEM_REG_IF, mem_get_reg16(gba->mem, MEM_REG_IF) | (1 << 2));
+			mem_raise_irq(gba->mem, (1 << 2));
 
 		/* vblank */
 		for (size_t i = 0; i < 960; ++i)
@@ -107,15 +153,21 @@ void gba_frame(gba_t *gba, uint8_t *video_buf, int16_t *audio_buf, uint32_t joyp
 		/* hblank */
 		mem_set_reg16(gba->mem, MEM_REG_DISPSTAT, (mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & 0xFFFC) | 0x3);
 		if (mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & (1 << 5) && mem_get_reg16(gba->mem, MEM_REG_DISPSTAT) & (1 << 4))
-			mem_set_reg16(gba->mem, MEM_REG_IF, mem_get_reg16(gba->mem, MEM_REG_IF) | (1 << 1));
+			mem_raise_irq(gba->mem, (1 << 1));
 
 		for (size_t i = 0; i < 272; ++i)
 			gba_cycle(gba);
 	}
-	memcpy(video_buf, gba->gpu->data, sizeof(gba->gpu->data));
+	size_t video_size = 240 * 160 * (gba->gpu->format == GBA_VIDEO_XRGB8888 ? 4 : 2);
+	memcpy(video_buf, gpu_sync(gba->gpu), video_size);
 	memcpy(audio_buf, gba->apu->data, sizeof(gba->apu->data));
 }
 
+void gba_set_video_format(gba_t *gba, enum gba_video_format format)
+{
+	gpu_set_format(gba->gpu, format);
+}
+
 void gba_get_mbc_ram(gba_t *gba, uint8_t **data, size_t *size)
 {
 	*data = gba->mbc->backup;
@@ -161,5 +213,88 @@ void gba_test_keypad_int(gba_t *gba)
 	else
 		enabled = keys & keycnt;
 	if (enabled)
-		mem_set_reg16(gba->mem, MEM_REG_IF, mem_get_reg16(gba->mem, MEM_REG_IF) | (1 << 12));
+		mem_raise_irq(gba->mem, (1 << 12));
+}
+
+void gba_set_bios_hle(gba_t *gba, bool enabled)
+{
+	gba->cpu->bios_hle = enabled;
+}
+
+bool gba_set_profile(gba_t *gba, bool enabled)
+{
+	profile_t *profile = gba->cpu->profile;
+	if (!enabled)
+	{
+		cpu_set_profile(gba->cpu, NULL);
+		profile_del(profile);
+		return true;
+	}
+	if (profile)
+		return true;
+	profile = profile_new();
+	if (!profile)
+		return false;
+	cpu_set_profile(gba->cpu, profile);
+	return true;
+}
+
+void gba_dump_profile(gba_t *gba, FILE *fp, size_t max)
+{
+	if (gba->cpu->profile)
+		profile_dump(gba->cpu->profile, gba->cpu, fp, max);
+}
+
+bool gba_set_render_thread(gba_t *gba, bool enabled)
+{
+	return gpu_set_thread(gba->gpu, enabled);
+}
+
+bool gba_set_trace(gba_t *gba, size_t size, bool regs)
+{
+	trace_t *trace = gba->cpu->trace;
+	if (trace && trace->size >= size && !trace->regs == !regs)
+		return true;
+	cpu_set_trace(gba->cpu, NULL);
+	trace_del(trace);
+	if (!size)
+		return true;
+	trace = trace_new(size, regs);
+	if (!trace)
+		return false;
+	cpu_set_trace(gba->cpu, trace);
+	return true;
+}
+
+bool gba_save_trace(gba_t *gba, FILE *fp)
+{
+	if (!gba->cpu->trace)
+		return false;
+	return trace_save(gba->cpu->trace, fp);
+}
+
+void gba_set_break_cb(gba_t *gba, gba_break_cb_t cb, void *userdata)
+{
+	gba->break_cb = cb;
+	gba->break_userdata = userdata;
+}
+
+bool gba_add_breakpoint(gba_t *gba, uint32_t addr)
+{
+	return cpu_add_breakpoint(gba->cpu, addr);
+}
+
+bool gba_del_breakpoint(gba_t *gba, uint32_t addr)
+{
+	return cpu_del_breakpoint(gba->cpu, addr);
+}
+
+bool gba_add_watchpoint(gba_t *gba, uint32_t addr, uint32_t len, bool read, bool write)
+{
+	return mem_add_watchpoint(gba->mem, addr, len, (read ? MEM_WATCH_READ : 0) | (write ? MEM_WATCH_WRITE : 0));
+}
+
+bool gba_del_watchpoint(gba_t *gba, uint32_t addr)
+{
+	return mem_del_watchpoint(gba->mem, addr);
 }
@@ -1,14 +1,17 @@
 #ifndef GBA_H
 #define GBA_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef struct mbc_s mbc_t;
 typedef struct mem_s mem_t;
 typedef struct apu_s apu_t;
 typedef struct cpu_s cpu_t;
 typedef struct gpu_s gpu_t;
+typedef struct gba_s gba_t;
 
 enum gba_button
 {
@@ -24,8 +27,25 @@ enum gba_button
 	GBA_BUTTON_START  = (1 << 9),
 };
 
+enum gba_break
+{
+	GBA_BREAK_EXEC,
+	GBA_BREAK_READ,
+	GBA_BREAK_WRITE,
+};
+
+enum gba_video_format
+{
+	GBA_VIDEO_XRGB8888, /* 4 bytes per pixel */
+	GBA_VIDEO_RGB565,
+	GBA_VIDEO_0RGB1555,
+};
+
+typedef void (*gba_break_cb_t)(gba_t *gba, enum gba_break type, uint32_t addr, void *userdata);
+
 typedef struct gba_s
 {
+	void *arena; /* single allocation holding the instance */
 	mbc_t *mbc;
 	mem_t *mem;
 	apu_t *apu;
@@ -33,16 +53,42 @@ typedef struct gba_s
 	gpu_t *gpu;
 	uint32_t joypad;
 	uint32_t cycle;
+	gba_break_cb_t break_cb;
+	void *break_userdata;
 } gba_t;
 
 gba_t *gba_new(const void *rom_data, size_t rom_size);
+gba_t *gba_clone(gba_t *gba);
 void gba_del(gba_t *gba);
 
 void gba_frame(gba_t *gba, uint8_t *video_buf, int16_t *audio_buf, uint32_t joypad);
+void gba_set_video_format(gba_t *gba, enum gba_video_format format);
 
 void gba_get_mbc_ram(gba_t *gba, uint8_t **data, size_t *size);
 void gba_get_mbc_rtc(gba_t *gba, uint8_t **data, size_t *size);
 
 void gba_test_keypad_int(gba_t *gba);
 
+void gba_set_bios_hle(gba_t *gba, bool enabled);
+
+bool gba_set_profile(gba_t *gba, bool enabled);
+void gba_dump_profile(gba_t *gba, FILE *fp, size_t max);
+
+bool gba_set_render_thread(gba_t *gba, bool enabled);
+
+bool gba_set_trace(gba_t *gba, size_t size, bool regs);
+bool gba_save_trace(gba_t *gba, FILE *fp);
+
+void gba_set_break_cb(gba_t *gba, gba_break_cb_t cb, void *userdata);
+bool gba_add_breakpoint(gba_t *gba, uint32_t addr);
+bool gba_del_breakpoint(gba_t *gba, uint32_t addr);
+bool gba_add_watchpoint(gba_t *gba, uint32_t addr, uint32_t len, bool read, bool write);
+bool gba_del_watchpoint(gba_t *gba, uint32_t addr);
+
+static inline void gba_break(gba_t *gba, enum gba_break type, uint32_t addr)
+{
+	if (gba->break_cb)
+		gba->break_cb(gba, type, addr, gba->break_userdata);
+}
+
 #endif
@@ -2,6 +2,7 @@
 #include "mem.h"
 #include "gba.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -9,62 +10,97 @@
 
 #define TO8(v) (((uint32_t)(v) * 527 + 23) >> 6)
 
-#define RGB5TO8(v, a) \
-{ \
-	TO8((v >> 0xA) & 0x1F), \
-	TO8((v >> 0x5) & 0x1F), \
-	TO8((v >> 0x0) & 0x1F), \
-	a, \
-}
-
-#define SETRGB5(d, v, a) \
-do \
-{ \
-	uint8_t *dst = d; \
-	dst[0] = TO8((v >> 0xA) & 0x1F); \
-	dst[1] = TO8((v >> 0x5) & 0x1F); \
-	dst[2] = TO8((v >> 0x0) & 0x1F); \
-	dst[3] = a; \
-} while (0)
-
-enum layer_type
-{
-	LAYER_NONE,
-	LAYER_BD,
-	LAYER_BG0,
-	LAYER_BG1,
-	LAYER_BG2,
-	LAYER_BG3,
-	LAYER_OBJ,
-};
+#define RGB5TO8(v) \
+	((TO8((v >> 0xA) & 0x1F) << 0x00) \
+	| (TO8((v >> 0x5) & 0x1F) << 0x08) \
+	| (TO8((v >> 0x0) & 0x1F) << 0x10))
+
+/* 15 bit colors straight to the 16 bit output formats, green is widened as TO8 would */
+#define RGB5TO565(v) \
+	((((v) & 0x1F) << 0xB) \
+	| (((v) & 0x3E0) << 1) \
+	| (((v) >> 4) & 0x20) \
+	| (((v) >> 0xA) & 0x1F))
+
+#define RGB5TO1555(v) \
+	((((v) & 0x1F) << 0xA) \
+	| ((v) & 0x3E0) \
+	| (((v) >> 0xA) & 0x1F))
+
+/* 8 bit channels to the 16 bit output formats, keeping the top bits of each channel */
+#define RGB8TO565(v) \
+	((((v) >> 8) & 0xF800) \
+	| (((v) >> 5) & 0x7E0) \
+	| (((v) >> 3) & 0x1F))
+
+#define RGB8TO1555(v) \
+	((((v) >> 9) & 0x7C00) \
+	| (((v) >> 6) & 0x3E0) \
+	| (((v) >> 3) & 0x1F))
 
+#define EFFECT_ALPHA 1
+#define EFFECT_FADE  2
+
+#define OPAQUE 0x8000 /* unused bit of the 15 bit colors, set on the drawn pixels of the backgrounds */
+
+/* layers are kept as 15 bit colors until the composition converts the line to output pixels */
 typedef struct line_buff_s
 {
-	uint8_t bg0[240 * 4];
-	uint8_t bg1[240 * 4];
-	uint8_t bg2[240 * 4];
-	uint8_t bg3[240 * 4];
-	uint8_t obj[240 * 4];
+	uint16_t bg0[240];
+	uint16_t bg1[240];
+	uint16_t bg2[240];
+	uint16_t bg3[240];
+	uint16_t obj[240];
+	uint8_t obj_attr[240]; /* 0x80: drawn, 0x40: obj window, bits 1-3: priority, bit 0: semi transparent */
 } line_buff_t;
 
-gpu_t *gpu_new(mem_t *mem)
+void gpu_init(gpu_t *gpu, mem_t *mem, uint8_t *ram)
 {
-	gpu_t *gpu = calloc(sizeof(*gpu), 1);
-	if (!gpu)
-		return NULL;
-
 	gpu->mem = mem;
-	return gpu;
+	gpu->data = ram;
+	gpu->tiles = &ram[MEM_PAGE_ALIGN(GPU_DATA_SIZE)];
+	gpu->obj_lines = (uint8_t(*)[128])&ram[MEM_PAGE_ALIGN(GPU_DATA_SIZE) + MEM_PAGE_ALIGN(GPU_TILES_SIZE)];
 }
 
-void gpu_del(gpu_t *gpu)
+/* drop the decoded tiles and object lists of the vram and oam pages written since the last line */
+static void update_caches(gpu_t *gpu)
 {
-	if (!gpu)
+	if (gpu->cache_gen == gpu->mem->cache_gen)
 		return;
-	free(gpu);
+	gpu->cache_gen = gpu->mem->cache_gen;
+	for (size_t page = 0; page < sizeof(gpu->tiles_valid); ++page)
+	{
+		if (mem_take_cache_dirty(gpu->mem, 0x6000000 + (page << MEM_CACHE_SHIFT)))
+			gpu->tiles_valid[page] = 0;
+	}
+	for (size_t page = 0; page < (0x400 >> MEM_CACHE_SHIFT); ++page)
+	{
+		if (mem_take_cache_dirty(gpu->mem, 0x7000000 + (page << MEM_CACHE_SHIFT)))
+			gpu->obj_lines_valid = 0;
+	}
+}
+
+/* 8 palette indexes of a 4bpp tile row, the whole vram page is decoded on a miss */
+static inline const uint8_t *get_tile4_row(gpu_t *gpu, uint32_t tileaddr, uint32_t tiley)
+{
+	uint32_t page = tileaddr >> MEM_CACHE_SHIFT;
+	if (!gpu->tiles_valid[page])
+	{
+		const uint8_t *src = &gpu->mem->vram[page << MEM_CACHE_SHIFT];
+		uint8_t *dst = &gpu->tiles[(page << MEM_CACHE_SHIFT) * 2];
+		for (size_t i = 0; i < (1 << MEM_CACHE_SHIFT); ++i)
+		{
+			dst[i * 2 + 0] = src[i] & 0xF;
+			dst[i * 2 + 1] = src[i] >> 4;
+		}
+		gpu->tiles_valid[page] = 1;
+		mem_add_cache(gpu->mem, 0x6000000 + (page << MEM_CACHE_SHIFT), 1 << MEM_CACHE_SHIFT);
+	}
+	return &gpu->tiles[tileaddr * 2 + tiley * 8];
 }
 
-static void draw_background_text(gpu_t *gpu, uint8_t y, uint8_t bg, uint8_t *data)
+/* walks the map once per tile, emitting the part of each tile row that falls on the line */
+static void draw_background_text(gpu_t *gpu, uint8_t y, uint8_t bg, uint16_t *data)
 {
 	static const uint32_t mapwidths[]  = {32 * 8, 64 * 8, 32 * 8, 64 * 8};
 	static const uint32_t mapheights[] = {32 * 8, 32 * 8, 64 * 8, 64 * 8};
@@ -76,67 +112,77 @@ static void draw_background_text(gpu_t *gpu, uint8_t y, uint8_t bg, uint8_t *dat
 	uint32_t mapbase = ((bgcnt >> 8) & 0x1F) * 0x800;
 	uint32_t mapw = mapwidths[size];
 	uint32_t maph = mapheights[size];
-	for (int32_t x = 0; x < 240; ++x)
+	uint32_t vy = (y + bgvofs) % maph;
+	uint32_t mapy = vy / 8;
+	uint32_t tiley = vy % 8;
+	if (mapy >= 32)
+	{
+		mapy -= 32;
+		mapbase += 0x800;
+		if (size == 3)
+			mapbase += 0x800;
+	}
+	const uint16_t *palette = (const uint16_t*)gpu->mem->palette;
+	uint32_t vx = bghofs % mapw;
+	uint32_t x = 0;
+	while (x < 240)
 	{
-		int32_t vx = x + bghofs;
-		int32_t vy = y + bgvofs;
-		vx %= mapw;
-		vy %= maph;
-		if (vx < 0)
-			vx += mapw;
-		if (vy < 0)
-			vy += maph;
 		uint32_t mapx = vx / 8;
-		uint32_t mapy = vy / 8;
 		uint32_t tilex = vx % 8;
-		uint32_t tiley = vy % 8;
+		uint32_t len = 8 - tilex;
+		if (len > 240 - x)
+			len = 240 - x;
 		uint32_t mapoff = 0;
-		if (mapy >= 32)
-		{
-			mapy -= 32;
-			mapoff += 0x800;
-			if (size == 3)
-				mapoff += 0x800;
-		}
 		if (mapx >= 32)
 		{
 			mapx -= 32;
 			mapoff += 0x800;
 		}
-		uint32_t mapaddr = mapx + mapy * 32;
-		uint16_t map = mem_get_vram16(gpu->mem, mapbase + mapoff + mapaddr * 2);
+		uint16_t map = mem_get_vram16(gpu->mem, mapbase + mapoff + (mapx + mapy * 32) * 2);
 		uint16_t tileid = map & 0x3FF;
-		if (map & (1 << 10))
-			tilex = 7 - tilex;
-		if (map & (1 << 11))
-			tiley = 7 - tiley;
-		uint8_t paladdr;
-		uint16_t tileaddr = tilebase;
+		uint32_t row = (map & (1 << 11)) ? 7 - tiley : tiley;
+		const uint8_t *pixels;
+		uint8_t palbase;
 		if (bgcnt & (1 << 7))
 		{
-			tileaddr += tileid * 0x40;
-			paladdr = mem_get_vram8(gpu->mem, tileaddr + tilex + tiley * 8);
-			if (!paladdr)
-				continue;
+			pixels = &gpu->mem->vram[(uint16_t)(tilebase + tileid * 0x40) + row * 8];
+			palbase = 0;
 		}
 		else
 		{
-			tileaddr += tileid * 0x20;
-			paladdr = mem_get_vram8(gpu->mem, tileaddr + tilex / 2 + tiley * 4);
-			if (tilex & 1)
-				paladdr >>= 4;
-			else
-				paladdr &= 0xF;
+			pixels = get_tile4_row(gpu, (uint16_t)(tilebase + tileid * 0x20), row);
+			palbase = ((map >> 12) & 0xF) * 0x10;
+		}
+		int32_t step;
+		if (map & (1 << 10))
+		{
+			pixels += 7 - tilex;
+			step = -1;
+		}
+		else
+		{
+			pixels += tilex;
+			step = 1;
+		}
+		uint16_t *out = &data[x];
+		for (uint32_t i = 0; i < len; ++i)
+		{
+			uint8_t paladdr = pixels[(int32_t)i * step];
 			if (!paladdr)
 				continue;
-			paladdr += ((map >> 12) & 0xF) * 0x10;
+			out[i] = palette[(uint8_t)(palbase + paladdr)] | OPAQUE;
 		}
-		uint16_t val = mem_get_bg_palette(gpu->mem, paladdr * 2);
-		SETRGB5(&data[x * 4], val, 0xFF);
+		x += len;
+		vx = (vx + len) % mapw;
 	}
 }
 
-static void draw_background_affine(gpu_t *gpu, uint8_t y, uint8_t bg, uint8_t *data)
+/*
+ * texel coordinates, map and tile fetches are done for the whole line in
+ * branchless passes, pixels outside of a clipped map fetch the first texel
+ * and are masked out at the end
+ */
+static void draw_background_affine(gpu_t *gpu, uint8_t y, uint8_t bg, uint16_t *data)
 {
 	static const uint32_t mapsizes[]  = {16 * 8, 32 * 8, 64 * 8, 128 * 8};
 	uint16_t bgcnt = mem_get_reg16(gpu->mem, MEM_REG_BG0CNT + bg * 2);
@@ -149,44 +195,44 @@ static void draw_background_affine(gpu_t *gpu, uint8_t y, uint8_t bg, uint8_t *d
 	int16_t pc = mem_get_reg16(gpu->mem, MEM_REG_BG2PC + 0x10 * (bg - 2));
 	int32_t bgx = bg == 2 ? gpu->bg2x : gpu->bg3x;
 	int32_t bgy = bg == 2 ? gpu->bg2y : gpu->bg3y;
+	const uint8_t *vram = gpu->mem->vram;
+	const uint16_t *palette = (const uint16_t*)gpu->mem->palette;
+	uint32_t mapaddr[240];
+	uint32_t tileoff[240];
+	uint32_t visible[240];
+	uint32_t pixel[240];
 	for (int32_t x = 0; x < 240; ++x)
 	{
-		int32_t vx = bgx / 256;
-		int32_t vy = bgy / 256;
-		bgx += pa;
-		bgy += pc;
+		int32_t vx = (bgx + pa * x) / 256;
+		int32_t vy = (bgy + pc * x) / 256;
 		if (overflow)
 		{
-			vx %= mapsize;
-			vy %= mapsize;
-			if (vx < 0)
-				vx += mapsize;
-			if (vy < 0)
-				vy += mapsize;
-		}
-		else
-		{
-			if (vx < 0 || (uint32_t)vx >= mapsize
-			 || vy < 0 || (uint32_t)vy >= mapsize)
-				continue;
+			vx &= mapsize - 1;
+			vy &= mapsize - 1;
 		}
-		uint32_t mapx = vx / 8;
-		uint32_t mapy = vy / 8;
-		uint32_t tilex = vx % 8;
-		uint32_t tiley = vy % 8;
-		uint32_t mapaddr = mapx + mapy * (mapsize / 8);
-		uint16_t tileid = mem_get_vram8(gpu->mem, mapbase + mapaddr);
-		uint8_t paladdr;
-		uint16_t tileaddr = tilebase + tileid * 0x40;
-		paladdr = mem_get_vram8(gpu->mem, tileaddr + tilex + tiley * 8);
-		if (!paladdr)
-			continue;
-		uint16_t val = mem_get_bg_palette(gpu->mem, paladdr * 2);
-		SETRGB5(&data[x * 4], val, 0xFF);
+		uint8_t inside = (uint32_t)vx < mapsize && (uint32_t)vy < mapsize;
+		vx = inside ? vx : 0;
+		vy = inside ? vy : 0;
+		visible[x] = inside;
+		mapaddr[x] = mapbase + (vx / 8) + (vy / 8) * (mapsize / 8);
+		tileoff[x] = tilebase + (vx % 8) + (vy % 8) * 8;
 	}
+	/* bytes are fetched from aligned words for the fetches to become vector gathers */
+	for (size_t x = 0; x < 240; ++x)
+	{
+		uint32_t tileid = (*(const uint32_t*)&vram[mapaddr[x] & ~3] >> ((mapaddr[x] & 3) * 8)) & 0xFF;
+		uint32_t addr = tileoff[x] + tileid * 0x40;
+		uint32_t paladdr = (*(const uint32_t*)&vram[addr & ~3] >> ((addr & 3) * 8)) & 0xFF;
+		pixel[x] = visible[x] ? paladdr : 0;
+	}
+	uint16_t color[240];
+	for (size_t x = 0; x < 240; ++x)
+		color[x] = (*(const uint32_t*)&palette[pixel[x] & ~1] >> ((pixel[x] & 1) * 16)) | OPAQUE;
+	for (size_t x = 0; x < 240; ++x)
+		data[x] = pixel[x] ? color[x] : data[x];
 }
 
-static void draw_background_bitmap_3(gpu_t *gpu, uint8_t y, uint8_t *data)
+static void draw_background_bitmap_3(gpu_t *gpu, uint8_t y, uint16_t *data)
 {
 	int16_t pa = mem_get_reg16(gpu->mem, MEM_REG_BG2PA);
 	int16_t pc = mem_get_reg16(gpu->mem, MEM_REG_BG2PC);
@@ -202,12 +248,11 @@ static void draw_background_bitmap_3(gpu_t *gpu, uint8_t y, uint8_t *data)
 		 || vy < 0 || vy >= 160)
 			continue;
 		uint32_t addr = 2 * (vx + 240 * vy);
-		uint16_t val = mem_get_vram16(gpu->mem, addr);
-		SETRGB5(&data[x * 4], val, 0xFF);
+		data[x] = mem_get_vram16(gpu->mem, addr) | OPAQUE;
 	}
 }
 
-static void draw_background_bitmap_4(gpu_t *gpu, uint8_t y, uint8_t *data)
+static void draw_background_bitmap_4(gpu_t *gpu, uint8_t y, uint16_t *data)
 {
 	int16_t pa = mem_get_reg16(gpu->mem, MEM_REG_BG2PA);
 	int16_t pc = mem_get_reg16(gpu->mem, MEM_REG_BG2PC);
@@ -215,6 +260,7 @@ static void draw_background_bitmap_4(gpu_t *gpu, uint8_t y, uint8_t *data)
 	int32_t bgy = gpu->bg2y;
 	uint16_t dispcnt = mem_get_reg16(gpu->mem, MEM_REG_DISPCNT);
 	uint32_t addr_offset = (dispcnt & (1 << 4)) ? 0xA000 : 0;
+	const uint16_t *palette = (const uint16_t*)gpu->mem->palette;
 	for (int32_t x = 0; x < 240; ++x)
 	{
 		int32_t vx = bgx / 256;
@@ -228,20 +274,19 @@ static void draw_background_bitmap_4(gpu_t *gpu, uint8_t y, uint8_t *data)
 		uint8_t val = mem_get_vram8(gpu->mem, addr);
 		if (!val)
 			continue;
-		uint16_t col = mem_get_bg_palette(gpu->mem, val * 2);
-		SETRGB5(&data[x * 4], col, 0xFF);
+		data[x] = palette[val] | OPAQUE;
 	}
 }
 
-static void draw_background_bitmap_5(gpu_t *gpu, uint8_t y, uint8_t *data)
+static void draw_background_bitmap_5(gpu_t *gpu, uint8_t y, uint16_t *data)
 {
 	if (y < 16 || y > 143)
 	{
-		memset(&data[0], 0, 4 * 240);
+		memset(&data[0], 0, 2 * 240);
 		return;
 	}
-	memset(&data[0], 0, 4 * 40);
-	memset(&data[200 * 4], 0, 4 * 40);
+	memset(&data[0], 0, 2 * 40);
+	memset(&data[200], 0, 2 * 40);
 	int16_t pa = mem_get_reg16(gpu->mem, MEM_REG_BG2PA);
 	int16_t pc = mem_get_reg16(gpu->mem, MEM_REG_BG2PC);
 	int32_t bgx = gpu->bg2x;
@@ -257,29 +302,42 @@ static void draw_background_bitmap_5(gpu_t *gpu, uint8_t y, uint8_t *data)
 		 || vy < 0 || vy >= 128)
 			continue;
 		uint32_t addr = baseaddr + 2 * (vx + 160 * vy);
-		uint16_t val = mem_get_vram16(gpu->mem, addr);
-		SETRGB5(&data[(40 + x) * 4], val, 0xFF);
+		data[40 + x] = mem_get_vram16(gpu->mem, addr) | OPAQUE;
 	}
 }
 
-static void draw_objects(gpu_t *gpu, uint32_t tileaddr, uint8_t y, uint8_t *data)
+static const uint8_t obj_widths[16] =
 {
-	static const uint8_t widths[16] =
-	{
-		8 , 16, 32, 64,
-		16, 32, 32, 64,
-		8 , 8 , 16, 32,
-		0 , 0 , 0 , 0 ,
-	};
-	static const uint8_t heights[16] =
-	{
-		8 , 16, 32, 64,
-		8 , 8 , 16, 32,
-		16, 32, 32, 64,
-		0 , 0 , 0 , 0 ,
-	};
-	for (size_t i = 0; i < 240; ++i)
-		data[i * 4 + 3] = 0xE;
+	8 , 16, 32, 64,
+	16, 32, 32, 64,
+	8 , 8 , 16, 32,
+	0 , 0 , 0 , 0 ,
+};
+
+static const uint8_t obj_heights[16] =
+{
+	8 , 16, 32, 64,
+	8 , 8 , 16, 32,
+	16, 32, 32, 64,
+	0 , 0 , 0 , 0 ,
+};
+
+/*
+ * lists the visible objects of each line, in oam order, rebuilt once oam
+ * was written. a line has 1210 object render cycles, 954 when the hblank
+ * interval is free: a normal object takes its width, an affine one twice
+ * its width plus 10. the objects after the one running out of cycles are
+ * not drawn, that one is dropped whole
+ */
+static void update_obj_lines(gpu_t *gpu)
+{
+	uint8_t hblank = (mem_get_reg16(gpu->mem, MEM_REG_DISPCNT) >> 5) & 0x1;
+	if (gpu->obj_lines_valid && gpu->obj_lines_hblank == hblank)
+		return;
+	uint16_t budget = hblank ? 954 : 1210;
+	uint16_t cycles[160];
+	memset(cycles, 0, sizeof(cycles));
+	memset(gpu->obj_lines_nb, 0, sizeof(gpu->obj_lines_nb));
 	for (uint8_t i = 0; i < 128; ++i)
 	{
 		uint16_t attr0 = mem_get_oam16(gpu->mem, i * 8);
@@ -291,16 +349,55 @@ static void draw_objects(gpu_t *gpu, uint32_t tileaddr, uint8_t y, uint8_t *data
 		int16_t objy = attr0 & 0xFF;
 		if (objy >= 160)
 			objy -= 256;
-		if (objy > y)
-			continue;
+		uint16_t attr1 = mem_get_oam16(gpu->mem, i * 8 + 2);
+		uint8_t shape = (attr0 >> 14) & 0x3;
+		uint8_t size = (attr1 >> 14) & 0x3;
+		int16_t width = obj_widths[size + shape * 4];
+		int16_t height = obj_heights[size + shape * 4];
+		if ((attr0 >> 9) & 0x1)
+		{
+			width *= 2;
+			height *= 2;
+		}
+		uint16_t cost = ((attr0 >> 8) & 0x1) ? width * 2 + 10 : width;
+		int16_t first = objy < 0 ? 0 : objy;
+		int16_t last = objy + height > 160 ? 160 : objy + height;
+		for (int16_t y = first; y < last; ++y)
+		{
+			if (cycles[y] + cost > budget)
+			{
+				cycles[y] = budget;
+				continue;
+			}
+			cycles[y] += cost;
+			gpu->obj_lines[y][gpu->obj_lines_nb[y]++] = i;
+		}
+	}
+	gpu->obj_lines_valid = 1;
+	gpu->obj_lines_hblank = hblank;
+	mem_add_cache(gpu->mem, 0x7000000, 0x400);
+}
+
+static void draw_objects(gpu_t *gpu, uint32_t tileaddr, uint8_t y, uint16_t *data, uint8_t *attr)
+{
+	memset(attr, 0xE, 240);
+	update_obj_lines(gpu);
+	for (uint8_t n = 0; n < gpu->obj_lines_nb[y]; ++n)
+	{
+		uint8_t i = gpu->obj_lines[y][n];
+		uint16_t attr0 = mem_get_oam16(gpu->mem, i * 8);
+		uint8_t mode = (attr0 >> 10) & 0x3;
+		int16_t objy = attr0 & 0xFF;
+		if (objy >= 160)
+			objy -= 256;
 		uint16_t attr1 = mem_get_oam16(gpu->mem, i * 8 + 2);
 		int16_t objx = attr1 & 0x1FF;
 		if (objx >= 240)
 			objx -= 512;
 		uint8_t shape = (attr0 >> 14) & 0x3;
 		uint8_t size = (attr1 >> 14) & 0x3;
-		uint8_t width = widths[size + shape * 4];
-		uint8_t height = heights[size + shape * 4];
+		uint8_t width = obj_widths[size + shape * 4];
+		uint8_t height = obj_heights[size + shape * 4];
 		uint8_t basewidth = width;
 		uint8_t baseheight = height;
 		uint8_t doublesize = (attr0 >> 9) & 0x1;
@@ -309,8 +406,6 @@ static void draw_objects(gpu_t *gpu, uint32_t tileaddr, uint8_t y, uint8_t *data
 			width *= 2;
 			height *= 2;
 		}
-		if (objy + height <= y)
-			continue;
 		uint8_t affine = (attr0 >> 8) & 0x1;
 		int16_t pa;
 		int16_t pb;
@@ -417,222 +512,164 @@ static void draw_objects(gpu_t *gpu, uint32_t tileaddr, uint8_t y, uint8_t *data
 				continue;
 			if (!color_mode)
 				tilev += palette * 0x10;
-			uint16_t col = mem_get_obj_palette(gpu->mem, tilev * 2);
+			uint16_t color = mem_get_obj_palette(gpu->mem, tilev * 2);
 			if (mode == 2)
 			{
-				if (col)
-					data[screenx * 4 + 3] |= 0x40;
+				if (color)
+					attr[screenx] |= 0x40;
 				continue;
 			}
-			if (priority >= ((data[screenx * 4 + 3] >> 1) & 0x7))
+			if (priority >= ((attr[screenx] >> 1) & 0x7))
 				continue;
-			SETRGB5(&data[screenx * 4], col, 0x80 | (mode & 1) | (priority << 1) | (data[screenx * 4 + 3] & 0x40));
+			data[screenx] = color;
+			attr[screenx] = 0x80 | (mode & 1) | (priority << 1) | (attr[screenx] & 0x40);
 		}
 	}
 }
 
-static const uint8_t *layer_data(line_buff_t *line, enum layer_type layer, const uint8_t *bd_color, uint32_t n, uint8_t mask)
-{
-	switch (layer)
-	{
-		case LAYER_NONE:
-			return NULL;
-		case LAYER_BD:
-			if (mask & (1 << 5))
-				return bd_color;
-			return NULL;
-		case LAYER_BG0:
-			if (mask & (1 << 0))
-				return &line->bg0[n];
-			return NULL;
-		case LAYER_BG1:
-			if (mask & (1 << 1))
-				return &line->bg1[n];
-			return NULL;
-		case LAYER_BG2:
-			if (mask & (1 << 2))
-				return &line->bg2[n];
-			return NULL;
-		case LAYER_BG3:
-			if (mask & (1 << 3))
-				return &line->bg3[n];
-			return NULL;
-		case LAYER_OBJ:
-			if (mask & (1 << 4))
-				return &line->obj[n];
-			return NULL;
-	}
-	assert(!"unknown layer");
-	return NULL;
+static void fill_window(uint8_t *win, uint32_t l, uint32_t r, uint8_t flags)
+{
+	if (r > 240)
+		r = 240;
+	if (l < r)
+		memset(&win[l], flags, r - l);
+}
+
+/* a window covers [left, right) of the lines in [top, bottom), both ranges wrap around when reversed */
+static void draw_window(uint8_t *win, uint16_t winh, uint16_t winv, uint8_t y, uint8_t flags)
+{
+	uint8_t l = winh >> 8;
+	uint8_t r = winh & 0xFF;
+	uint8_t t = winv >> 8;
+	uint8_t b = winv & 0xFF;
+	if (t > b ? (y < t && y >= b) : (y < t || y >= b))
+		return;
+	if (l > r)
+	{
+		fill_window(win, 0, r, flags);
+		fill_window(win, l, 240, flags);
+	}
+	else
+	{
+		fill_window(win, l, r, flags);
+	}
 }
 
-static void calcwindow(gpu_t *gpu, line_buff_t *line, uint8_t x, uint8_t y, uint8_t *winflags)
+/* layer enable flags of each pixel of the line, painted from the lowest to the highest priority window */
+static void draw_windows(gpu_t *gpu, line_buff_t *line, uint8_t y, uint8_t *win)
 {
 	uint16_t dispcnt = mem_get_reg16(gpu->mem, MEM_REG_DISPCNT);
-	uint16_t win0h = mem_get_reg16(gpu->mem, MEM_REG_WIN0H);
-	uint16_t win0v = mem_get_reg16(gpu->mem, MEM_REG_WIN0V);
-	uint16_t win1h = mem_get_reg16(gpu->mem, MEM_REG_WIN1H);
-	uint16_t win1v = mem_get_reg16(gpu->mem, MEM_REG_WIN1V);
+	if (!(dispcnt & (7 << 13)))
+	{
+		memset(win, 0xFF, 240);
+		return;
+	}
 	uint16_t winin = mem_get_reg16(gpu->mem, MEM_REG_WININ);
 	uint16_t winout = mem_get_reg16(gpu->mem, MEM_REG_WINOUT);
-	uint8_t win0l = win0h >> 8;
-	uint8_t win0r = win0h & 0xFF;
-	uint8_t win0t = win0v >> 8;
-	uint8_t win0b = win0v & 0xFF;
-	uint8_t win1l = win1h >> 8;
-	uint8_t win1r = win1h & 0xFF;
-	uint8_t win1t = win1v >> 8;
-	uint8_t win1b = win1v & 0xFF;
-	if (dispcnt & (1 << 13))
+	memset(win, winout & 0xFF, 240);
+	if (dispcnt & (1 << 15))
 	{
-		if (win0l > win0r)
-		{
-			if (win0t > win0b)
-			{
-				if ((x < win0r || x >= win0l)
-				 && (y >= win0t || y < win0b))
-				{
-					*winflags = winin & 0xFF;
-					return;
-				}
-			}
-			else
-			{
-				if ((x < win0r || x >= win0l)
-				 && y >= win0t && y < win0b)
-				{
-					*winflags = winin & 0xFF;
-					return;
-				}
-			}
-		}
-		else
-		{
-			if (win0t > win0b)
-			{
-				if (x >= win0l && x < win0r
-				 && (y >= win0t || y < win0b))
-				{
-					*winflags = winin & 0xFF;
-					return;
-				}
-			}
-			else
-			{
-				if (x >= win0l && x < win0r
-				 && y >= win0t && y < win0b)
-				{
-					*winflags = winin & 0xFF;
-					return;
-				}
-			}
-		}
+		for (size_t x = 0; x < 240; ++x)
+			win[x] = (line->obj_attr[x] & 0x40) ? winout >> 8 : win[x];
 	}
 	if (dispcnt & (1 << 14))
+		draw_window(win, mem_get_reg16(gpu->mem, MEM_REG_WIN1H), mem_get_reg16(gpu->mem, MEM_REG_WIN1V), y, winin >> 8);
+	if (dispcnt & (1 << 13))
+		draw_window(win, mem_get_reg16(gpu->mem, MEM_REG_WIN0H), mem_get_reg16(gpu->mem, MEM_REG_WIN0V), y, winin & 0xFF);
+}
+
+#define LAYER_BG0 (1 << 0)
+#define LAYER_OBJ (1 << 4)
+#define LAYER_BD  (1 << 5)
+#define LAYER_OBJ_ALPHA (1 << 6) /* semi transparent obj on top, always a first target */
+
+/*
+ * the two topmost layers of each pixel, as planes over the line so that
+ * each step of the composition is a flat loop over 240 pixels
+ */
+typedef struct compose_row_s
+{
+	uint16_t top[240];
+	uint16_t bot[240];
+	uint8_t top_layer[240];
+	uint8_t bot_layer[240];
+	uint8_t top_prio[240];
+	uint8_t bot_prio[240];
+	uint8_t win[240];
+} compose_row_t;
+
+/* layers are pushed back to front: each visible pixel moves the current top down */
+static void push_background(compose_row_t *row, const uint16_t *data, uint8_t bg, uint8_t prio)
+{
+	for (size_t x = 0; x < 240; ++x)
 	{
-		if (win1l > win1r)
-		{
-			if (win1t > win1b)
-			{
-				if ((x < win1r || x >= win1l)
-				 && (y >= win1t || y < win1b))
-				{
-					*winflags = winin >> 8;
-					return;
-				}
-			}
-			else
-			{
-				if ((x < win1r || x >= win1l)
-				 && y >= win1t && y < win1b)
-				{
-					*winflags = winin >> 8;
-					return;
-				}
-			}
-		}
-		else
-		{
-			if (win1t > win1b)
-			{
-				if (x >= win1l && x < win1r
-				 && (y >= win1t || y < win1b))
-				{
-					*winflags = winin >> 8;
-					return;
-				}
-			}
-			else
-			{
-				if (x >= win1l && x < win1r
-				 && y >= win1t && y < win1b)
-				{
-					*winflags = winin >> 8;
-					return;
-				}
-			}
-		}
+		bool visible = ((row->win[x] >> bg) & 1) && (data[x] & OPAQUE);
+		row->bot[x] = visible ? row->top[x] : row->bot[x];
+		row->bot_layer[x] = visible ? row->top_layer[x] : row->bot_layer[x];
+		row->bot_prio[x] = visible ? row->top_prio[x] : row->bot_prio[x];
+		row->top[x] = visible ? data[x] : row->top[x];
+		row->top_layer[x] = visible ? LAYER_BG0 << bg : row->top_layer[x];
+		row->top_prio[x] = visible ? prio : row->top_prio[x];
 	}
-	if (dispcnt & (1 << 15))
+}
+
+/* objects win priority ties against backgrounds, and may land under the top layer */
+static void push_objects(compose_row_t *row, const uint16_t *data, const uint8_t *attr)
+{
+	for (size_t x = 0; x < 240; ++x)
 	{
-		if (line->obj[x * 4 + 3] & 0x40)
-		{
-			*winflags = winout >> 8;
-			return;
-		}
+		uint8_t obj = attr[x];
+		uint8_t prio = (obj >> 1) & 3;
+		bool visible = (row->win[x] & LAYER_OBJ) && (obj & 0x80);
+		bool top = visible && prio <= row->top_prio[x];
+		bool bot = visible && !top && prio <= row->bot_prio[x];
+		row->bot[x] = top ? row->top[x] : (bot ? data[x] : row->bot[x]);
+		row->bot_layer[x] = top ? row->top_layer[x] : (bot ? LAYER_OBJ : row->bot_layer[x]);
+		row->bot_prio[x] = top ? row->top_prio[x] : (bot ? prio : row->bot_prio[x]);
+		row->top[x] = top ? data[x] : row->top[x];
+		row->top_layer[x] = top ? LAYER_OBJ | ((obj & 1) ? LAYER_OBJ_ALPHA : 0) : row->top_layer[x];
+		row->top_prio[x] = top ? prio : row->top_prio[x];
 	}
-	*winflags = winout & 0xFF;
+}
+
+static inline uint32_t blend_alpha(uint32_t top, uint32_t bot, uint8_t eva, uint8_t evb)
+{
+#define BLEND_ALPHA(n) \
+	((((((top >> n) & 0xFF) * eva + ((bot >> n) & 0xFF) * evb) >> 4) > 0xFF \
+	? 0xFF : ((((top >> n) & 0xFF) * eva + ((bot >> n) & 0xFF) * evb) >> 4)) << n)
+	return BLEND_ALPHA(0) | BLEND_ALPHA(8) | BLEND_ALPHA(16);
+#undef BLEND_ALPHA
+}
+
+static inline uint32_t blend_brighten(uint32_t top, uint8_t bldy)
+{
+#define BLEND_BRIGHTEN(n) \
+	((((((top >> n) & 0xFF) + (((0xFF - ((top >> n) & 0xFF)) * bldy) >> 4))) & 0xFF) << n)
+	return BLEND_BRIGHTEN(0) | BLEND_BRIGHTEN(8) | BLEND_BRIGHTEN(16);
+#undef BLEND_BRIGHTEN
+}
+
+static inline uint32_t blend_darken(uint32_t top, uint8_t bldy)
+{
+#define BLEND_DARKEN(n) \
+	((((((top >> n) & 0xFF) - ((((top >> n) & 0xFF) * bldy) >> 4))) & 0xFF) << n)
+	return BLEND_DARKEN(0) | BLEND_DARKEN(8) | BLEND_DARKEN(16);
+#undef BLEND_DARKEN
+}
+
+/* the 8 bit channels of a pixel with its alpha blending or fade applied */
+static inline uint32_t effect_color(uint8_t effect, uint8_t blending, uint16_t top, uint16_t bot, uint8_t eva, uint8_t evb, uint8_t bldy)
+{
+	uint32_t top8 = RGB5TO8(top);
+	if (effect == EFFECT_ALPHA)
+		return blend_alpha(top8, RGB5TO8(bot), eva, evb);
+	return blending == 2 ? blend_brighten(top8, bldy) : blend_darken(top8, bldy);
 }
 
 static void compose(gpu_t *gpu, line_buff_t *line, uint8_t y)
 {
-	uint16_t bd_col = mem_get_bg_palette(gpu->mem, 0);
-	uint8_t bd_color[4] = RGB5TO8(bd_col, 0xFF);
-	for (size_t x = 0; x < 240; ++x)
-	{
-		memcpy(&gpu->data[(240 * y + x) * 4], bd_color, 4);
-#if 0
-		line->bg0[x * 4 + 0] = line->bg0[x * 4 + 0] / 4 + 0xBF;
-		line->bg0[x * 4 + 1] = line->bg0[x * 4 + 1] / 4;
-		line->bg0[x * 4 + 2] = line->bg0[x * 4 + 2] / 4;
-		line->bg1[x * 4 + 0] = line->bg1[x * 4 + 0] / 4;
-		line->bg1[x * 4 + 1] = line->bg1[x * 4 + 1] / 4 + 0xBF;
-		line->bg1[x * 4 + 2] = line->bg1[x * 4 + 2] / 4;
-		line->bg2[x * 4 + 0] = line->bg2[x * 4 + 0] / 4;
-		line->bg2[x * 4 + 1] = line->bg2[x * 4 + 1] / 4;
-		line->bg2[x * 4 + 2] = line->bg2[x * 4 + 2] / 4 + 0xBF;
-		line->bg3[x * 4 + 0] = line->bg3[x * 4 + 0] / 4 + 0xBF;
-		line->bg3[x * 4 + 1] = line->bg3[x * 4 + 1] / 4 + 0xBF;
-		line->bg3[x * 4 + 2] = line->bg3[x * 4 + 2] / 4;
-		line->obj[x * 4 + 0] = line->obj[x * 4 + 0] / 4 + 0xBF;
-		line->obj[x * 4 + 1] = line->obj[x * 4 + 1] / 4;
-		line->obj[x * 4 + 2] = line->obj[x * 4 + 2] / 4 + 0xBF;
-#endif
-#if 0
-		uint8_t prio;
-		prio = mem_get_reg16(gpu->mem, MEM_REG_BG0CNT) & 3;
-		line->bg0[x * 4 + 0] = line->bg0[x * 4 + 0] / 8 + prio * 0x3F;
-		line->bg0[x * 4 + 1] = line->bg0[x * 4 + 1] / 8 + prio * 0x3F;
-		line->bg0[x * 4 + 2] = line->bg0[x * 4 + 2] / 8 + prio * 0x3F;
-		prio = mem_get_reg16(gpu->mem, MEM_REG_BG1CNT) & 3;
-		line->bg1[x * 4 + 0] = line->bg1[x * 4 + 0] / 8 + prio * 0x3F;
-		line->bg1[x * 4 + 1] = line->bg1[x * 4 + 1] / 8 + prio * 0x3F;
-		line->bg1[x * 4 + 2] = line->bg1[x * 4 + 2] / 8 + prio * 0x3F;
-		prio = mem_get_reg16(gpu->mem, MEM_REG_BG2CNT) & 3;
-		line->bg2[x * 4 + 0] = line->bg2[x * 4 + 0] / 8 + prio * 0x3F;
-		line->bg2[x * 4 + 1] = line->bg2[x * 4 + 1] / 8 + prio * 0x3F;
-		line->bg2[x * 4 + 2] = line->bg2[x * 4 + 2] / 8 + prio * 0x3F;
-		prio = mem_get_reg16(gpu->mem, MEM_REG_BG3CNT) & 3;
-		line->bg3[x * 4 + 0] = line->bg3[x * 4 + 0] / 8 + prio * 0x3F;
-		line->bg3[x * 4 + 1] = line->bg3[x * 4 + 1] / 8 + prio * 0x3F;
-		line->bg3[x * 4 + 2] = line->bg3[x * 4 + 2] / 8 + prio * 0x3F;
-		prio = (line->obj[x * 4 + 3] >> 1) & 3;
-		line->obj[x * 4 + 0] = line->obj[x * 4 + 0] / 8 + prio * 0x3F;
-		line->obj[x * 4 + 1] = line->obj[x * 4 + 1] / 8 + prio * 0x3F;
-		line->obj[x * 4 + 2] = line->obj[x * 4 + 2] / 8 + prio * 0x3F;
-#endif
-	}
-	uint8_t *bg_data[4] = {&line->bg0[0], &line->bg1[0], &line->bg2[0], &line->bg3[0]};
+	compose_row_t row;
+	const uint16_t *bg_data[4] = {&line->bg0[0], &line->bg1[0], &line->bg2[0], &line->bg3[0]};
 	uint8_t bg_order[4];
 	uint8_t bg_order_cnt = 0;
 	uint8_t bg_prio[4];
@@ -649,158 +686,67 @@ static void compose(gpu_t *gpu, line_buff_t *line, uint8_t y)
 			}
 		}
 	}
-	uint16_t dispcnt = mem_get_reg16(gpu->mem, MEM_REG_DISPCNT);
-	bool has_window = (dispcnt & (7 << 13)) != 0;
 	uint16_t bldcnt = mem_get_reg16(gpu->mem, MEM_REG_BLDCNT);
-	uint8_t top_mask = (bldcnt >> 0) & 0x3F;
+	uint8_t top_mask = ((bldcnt >> 0) & 0x3F) | LAYER_OBJ_ALPHA;
 	uint8_t bot_mask = (bldcnt >> 8) & 0x3F;
 	uint8_t blending = (bldcnt >> 6) & 3;
 	uint16_t bldalpha = mem_get_reg16(gpu->mem, MEM_REG_BLDALPHA);
 	uint8_t bldy = mem_get_reg16(gpu->mem, MEM_REG_BLDY) & 0x1F;
 	uint8_t eva = (bldalpha >> 0) & 0x1F;
 	uint8_t evb = (bldalpha >> 8) & 0x1F;
+	uint16_t bd_color = mem_get_bg_palette(gpu->mem, 0);
+	draw_windows(gpu, line, y, row.win);
 	for (size_t x = 0; x < 240; ++x)
 	{
-		uint8_t *dst = &gpu->data[(y * 240 + x) * 4];
-		uint8_t winflags;
-		if (has_window)
-		{
-			calcwindow(gpu, line, x, y, &winflags);
-		}
-		else
-		{
-			winflags = 0xFF;
-		}
-		uint8_t pixel_blend = blending;
-		if (!(winflags & (1 << 5)))
-			pixel_blend = 0;
-		if (!pixel_blend && !(line->obj[x * 4 + 3] & 1))
-		{
-			enum layer_type layer = LAYER_BD;
-			uint8_t priority = 4;
-			for (size_t i = 0; i < bg_order_cnt; ++i)
-			{
-				uint8_t bgid = bg_order[i];
-				if ((winflags & (1 << bgid)) && bg_data[bgid][x * 4 + 3])
-				{
-					layer = LAYER_BG0 + bgid;
-					priority = bg_prio[i];
-					break;
-				}
-			}
-			if (winflags & (1 << 4))
-			{
-				uint8_t obj = line->obj[x * 4 + 3];
-				if ((obj & 0x80) && ((obj >> 1) & 3) <= priority)
-					layer = LAYER_OBJ;
-			}
-			memcpy(dst, layer_data(line, layer, bd_color, x * 4, 0xFF), 3);
-			continue;
-		}
-		enum layer_type top_layer = LAYER_BD;
-		enum layer_type bot_layer = LAYER_BD;
-		uint8_t top_priority = 4;
-		uint8_t bot_priority = 4;
-		uint8_t alpha_obj_mask = 0;
-		for (size_t i = 0; i < bg_order_cnt; ++i)
+		row.top[x] = bd_color;
+		row.bot[x] = bd_color;
+		row.top_layer[x] = LAYER_BD;
+		row.bot_layer[x] = LAYER_BD;
+		row.top_prio[x] = 4;
+		row.bot_prio[x] = 4;
+	}
+	for (size_t i = bg_order_cnt; i > 0; --i)
+		push_background(&row, bg_data[bg_order[i - 1]], bg_order[i - 1], bg_prio[i - 1]);
+	push_objects(&row, line->obj, line->obj_attr);
+	uint8_t effects[240];
+	for (size_t x = 0; x < 240; ++x)
+	{
+		uint32_t top_layer = row.top_layer[x];
+		uint32_t top_target = top_layer & top_mask;
+		uint32_t bot_target = row.bot_layer[x] & bot_mask;
+		uint32_t effect = (row.win[x] & (1 << 5)) && top_target;
+		uint32_t alpha = (top_layer & LAYER_OBJ_ALPHA) ? bot_target : (effect && blending == 1 && bot_target);
+		uint32_t fade = !alpha && effect && blending >= 2;
+		effects[x] = alpha ? EFFECT_ALPHA : (fade ? EFFECT_FADE : 0);
+	}
+	/* the 16 bit formats only widen the blended and faded pixels to 8 bit channels */
+	switch (gpu->format)
+	{
+		case GBA_VIDEO_XRGB8888:
 		{
-			uint8_t bgid = bg_order[i];
-			if (!(winflags & (1 << bgid)))
-				continue;
-			if (!bg_data[bgid][x * 4 + 3])
-				continue;
-			uint8_t prio = bg_prio[i];
-			if (prio < top_priority)
+			uint32_t *dst = (uint32_t*)&gpu->data[y * 240 * 4];
+			for (size_t x = 0; x < 240; ++x)
 			{
-				bot_layer = top_layer;
-				bot_priority = top_priority;
-				top_layer = LAYER_BG0 + bgid;
-				top_priority = prio;
-				continue;
-			}
-			if (prio < bot_priority)
-			{
-				bot_layer = LAYER_BG0 + bgid;
-				bot_priority = prio;
-				continue;
+				uint32_t top = RGB5TO8(row.top[x]);
+				uint32_t faded = blending == 2 ? blend_brighten(top, bldy) : blend_darken(top, bldy);
+				uint32_t res = effects[x] == EFFECT_ALPHA ? blend_alpha(top, RGB5TO8(row.bot[x]), eva, evb) : (effects[x] == EFFECT_FADE ? faded : top);
+				dst[x] = res | 0xFF000000;
 			}
+			break;
 		}
-		if (winflags & (1 << 4))
+		case GBA_VIDEO_RGB565:
 		{
-			uint8_t obj = line->obj[x * 4 + 3];
-			if (obj & 0x80)
-			{
-				uint8_t prio = (obj >> 1) & 3;
-				if (prio <= top_priority)
-				{
-					bot_priority = top_priority;
-					bot_layer = top_layer;
-					top_priority = prio;
-					top_layer = LAYER_OBJ;
-					alpha_obj_mask = (obj & 1) << 4;
-				}
-				else if (prio <= bot_priority)
-				{
-					bot_priority = prio;
-					bot_layer = LAYER_OBJ;
-				}
-			}
+			uint16_t *dst = (uint16_t*)&gpu->data[y * 240 * 2];
+			for (size_t x = 0; x < 240; ++x)
+				dst[x] = effects[x] ? RGB8TO565(effect_color(effects[x], blending, row.top[x], row.bot[x], eva, evb, bldy)) : RGB5TO565(row.top[x]);
+			break;
 		}
-		const uint8_t *top_layer_data = layer_data(line, top_layer, bd_color, x * 4, top_mask | alpha_obj_mask);
-		const uint8_t *bot_layer_data = layer_data(line, bot_layer, bd_color, x * 4, bot_mask);
-		if (alpha_obj_mask && bot_layer_data)
-			pixel_blend = 1;
-		switch (pixel_blend)
+		case GBA_VIDEO_0RGB1555:
 		{
-			case 0:
-				top_layer_data = layer_data(line, top_layer, bd_color, x * 4, 0xFF);
-				memcpy(dst, top_layer_data, 3);
-				break;
-			case 1:
-				if (top_layer_data && bot_layer_data)
-				{
-					for (size_t i = 0; i < 3; ++i)
-					{
-						uint16_t res = (top_layer_data[i] * eva + bot_layer_data[i] * evb) >> 4;
-						if (res > 0xFF)
-							res = 0xFF;
-						dst[i] = res;
-					}
-				}
-				else
-				{
-					top_layer_data = layer_data(line, top_layer, bd_color, x * 4, 0xFF);
-					memcpy(dst, top_layer_data, 3);
-				}
-				break;
-			case 2:
-			{
-				if (top_layer_data != NULL)
-				{
-					for (size_t i = 0; i < 3; ++i)
-						dst[i] = top_layer_data[i] + (((255 - top_layer_data[i]) * bldy) >> 4);
-				}
-				else
-				{
-					top_layer_data = layer_data(line, top_layer, bd_color, x * 4, 0xFF);
-					memcpy(dst, top_layer_data, 3);
-				}
-				break;
-			}
-			case 3:
-			{
-				if (top_layer_data != NULL)
-				{
-					for (size_t i = 0; i < 3; ++i)
-						dst[i] = top_layer_data[i] - ((top_layer_data[i] * bldy) >> 4);
-				}
-				else
-				{
-					top_layer_data = layer_data(line, top_layer, bd_color, x * 4, 0xFF);
-					memcpy(dst, top_layer_data, 3);
-				}
-				break;
-			}
+			uint16_t *dst = (uint16_t*)&gpu->data[y * 240 * 2];
+			for (size_t x = 0; x < 240; ++x)
+				dst[x] = effects[x] ? RGB8TO1555(effect_color(effects[x], blending, row.top[x], row.bot[x], eva, evb, bldy)) : RGB5TO1555(row.top[x]);
+			break;
 		}
 	}
 }
@@ -821,10 +767,11 @@ void gpu_commit_bgpos(gpu_t *gpu)
 	gpu->bg3y = gpu->bg3y;
 }
 
-void gpu_draw(gpu_t *gpu, uint8_t y)
+static void draw_line(gpu_t *gpu, uint8_t y)
 {
 	line_buff_t line;
 	memset(&line, 0, sizeof(line));
+	update_caches(gpu);
 	uint16_t dispcnt = mem_get_reg16(gpu->mem, MEM_REG_DISPCNT);
 	uint32_t objbase;
 	switch (dispcnt & 0x7)
@@ -872,12 +819,270 @@ void gpu_draw(gpu_t *gpu, uint8_t y)
 			objbase = 0x14000;
 			break;
 		default:
-			printf("invalid mode: %x\n", dispcnt & 0x7);
 			return;
 	}
 	if (dispcnt & (1 << 0xC))
-		draw_objects(gpu, objbase, y, line.obj);
+		draw_objects(gpu, objbase, y, line.obj, line.obj_attr);
 	compose(gpu, &line, y);
+}
+
+/*
+ * with a render thread, lines are drawn by a worker from a log: each line
+ * records the video registers and the palette, vram and oam pages written
+ * since the previous line, which the worker copies to its own memories
+ * before drawing the line
+ */
+#define LOG_LINE_PAGES (MEM_CACHE_PALETTE_PAGES + MEM_CACHE_VRAM_PAGES + MEM_CACHE_OAM_PAGES)
+#define LOG_PAGES (LOG_LINE_PAGES * 2)
+
+typedef struct log_line_s
+{
+	uint8_t y;
+	uint8_t regs[MEM_REG_BLDY + 2];
+	int32_t bg2x;
+	int32_t bg2y;
+	int32_t bg3x;
+	int32_t bg3y;
+	uint32_t pages;
+	uint32_t pages_nb;
+} log_line_t;
+
+typedef struct log_page_s
+{
+	uint32_t addr;
+	uint8_t data[1 << MEM_CACHE_SHIFT];
+} log_page_t;
+
+struct gpu_thread_s
+{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t logged_cond;
+	pthread_cond_t drawn_cond;
+	bool quit;
+	uint32_t lines_nb; /* lines logged since the last gpu_sync */
+	uint32_t lines_drawn;
+	uint32_t pages_nb;
+	uint32_t cache_gen;
+	log_line_t lines[160];
+	log_page_t pages[LOG_PAGES];
+	gpu_t gpu;
+	mem_t mem;
+	uint8_t ram[MEM_VIDEO_RAM_SIZE];
+	uint8_t gpu_ram[GPU_RAM_SIZE];
+};
+
+static void draw_log_line(gpu_thread_t *thread, const log_line_t *line)
+{
+	for (uint32_t i = 0; i < line->pages_nb; ++i)
+	{
+		const log_page_t *page = &thread->pages[line->pages + i];
+		mem_set_page(&thread->mem, page->addr, page->data);
+	}
+	memcpy(thread->mem.io_regs, line->regs, sizeof(line->regs));
+	thread->gpu.bg2x = line->bg2x;
+	thread->gpu.bg2y = line->bg2y;
+	thread->gpu.bg3x = line->bg3x;
+	thread->gpu.bg3y = line->bg3y;
+	draw_line(&thread->gpu, line->y);
+}
+
+static void *thread_main(void *arg)
+{
+	gpu_thread_t *thread = arg;
+	pthread_mutex_lock(&thread->mutex);
+	while (1)
+	{
+		while (!thread->quit && thread->lines_drawn == thread->lines_nb)
+			pthread_cond_wait(&thread->logged_cond, &thread->mutex);
+		if (thread->lines_drawn == thread->lines_nb)
+			break;
+		const log_line_t *line = &thread->lines[thread->lines_drawn];
+		pthread_mutex_unlock(&thread->mutex);
+		draw_log_line(thread, line);
+		pthread_mutex_lock(&thread->mutex);
+		thread->lines_drawn++;
+		pthread_cond_signal(&thread->drawn_cond);
+	}
+	pthread_mutex_unlock(&thread->mutex);
+	return NULL;
+}
+
+static void wait_lines(gpu_thread_t *thread)
+{
+	pthread_mutex_lock(&thread->mutex);
+	while (thread->lines_drawn != thread->lines_nb)
+		pthread_cond_wait(&thread->drawn_cond, &thread->mutex);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+static void log_pages(gpu_thread_t *thread, mem_t *mem, uint32_t addr, uint32_t size)
+{
+	for (uint32_t end = addr + size; addr < end; addr += 1 << MEM_CACHE_SHIFT)
+	{
+		if (!mem_take_cache_dirty(mem, addr))
+			continue;
+		const mem_tlb_t *tlb = &mem->tlb_set[addr >> 24];
+		log_page_t *page = &thread->pages[thread->pages_nb++];
+		page->addr = addr;
+		memcpy(page->data, &tlb->data[addr & tlb->mask], sizeof(page->data));
+		mem_add_cache(mem, addr, 1 << MEM_CACHE_SHIFT);
+	}
+}
+
+static void log_line(gpu_t *gpu, uint8_t y)
+{
+	gpu_thread_t *thread = gpu->thread;
+	mem_t *mem = gpu->mem;
+	if (thread->pages_nb + LOG_LINE_PAGES > LOG_PAGES)
+	{
+		/* the pages of the logged lines are only reused once they are drawn */
+		wait_lines(thread);
+		thread->pages_nb = 0;
+	}
+	log_line_t *line = &thread->lines[thread->lines_nb];
+	line->y = y;
+	memcpy(line->regs, mem->io_regs, sizeof(line->regs));
+	line->bg2x = gpu->bg2x;
+	line->bg2y = gpu->bg2y;
+	line->bg3x = gpu->bg3x;
+	line->bg3y = gpu->bg3y;
+	line->pages = thread->pages_nb;
+	if (thread->cache_gen != mem->cache_gen)
+	{
+		thread->cache_gen = mem->cache_gen;
+		log_pages(thread, mem, 0x5000000, MEM_PALETTE_SIZE);
+		log_pages(thread, mem, 0x6000000, MEM_VRAM_SIZE);
+		log_pages(thread, mem, 0x7000000, MEM_OAM_SIZE);
+	}
+	line->pages_nb = thread->pages_nb - line->pages;
+	pthread_mutex_lock(&thread->mutex);
+	thread->lines_nb++;
+	pthread_cond_signal(&thread->logged_cond);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+static void stop_thread(gpu_t *gpu)
+{
+	gpu_thread_t *thread = gpu->thread;
+	pthread_mutex_lock(&thread->mutex);
+	thread->quit = true;
+	pthread_cond_signal(&thread->logged_cond);
+	pthread_mutex_unlock(&thread->mutex);
+	pthread_join(thread->thread, NULL);
+	pthread_cond_destroy(&thread->drawn_cond);
+	pthread_cond_destroy(&thread->logged_cond);
+	pthread_mutex_destroy(&thread->mutex);
+	memcpy(gpu->data, thread->gpu.data, GPU_DATA_SIZE);
+	free(thread);
+	gpu->thread = NULL;
+	/* the log took the write tracking from the caches */
+	memset(gpu->tiles_valid, 0, sizeof(gpu->tiles_valid));
+	gpu->obj_lines_valid = 0;
+}
+
+bool gpu_set_thread(gpu_t *gpu, bool enabled)
+{
+	if (!enabled)
+	{
+		if (gpu->thread)
+			stop_thread(gpu);
+		return true;
+	}
+	if (gpu->thread)
+		return true;
+	gpu_thread_t *thread = calloc(1, sizeof(*thread));
+	if (!thread)
+		return false;
+	mem_init_video(&thread->mem, gpu->mem, thread->ram);
+	gpu_init(&thread->gpu, &thread->mem, thread->gpu_ram);
+	thread->gpu.format = gpu->format;
+	memcpy(thread->gpu.data, gpu->data, GPU_DATA_SIZE);
+	thread->cache_gen = gpu->mem->cache_gen;
+	pthread_mutex_init(&thread->mutex, NULL);
+	pthread_cond_init(&thread->logged_cond, NULL);
+	pthread_cond_init(&thread->drawn_cond, NULL);
+	if (pthread_create(&thread->thread, NULL, thread_main, thread))
+	{
+		pthread_cond_destroy(&thread->drawn_cond);
+		pthread_cond_destroy(&thread->logged_cond);
+		pthread_mutex_destroy(&thread->mutex);
+		free(thread);
+		return false;
+	}
+	mem_add_cache(gpu->mem, 0x5000000, MEM_PALETTE_SIZE);
+	mem_add_cache(gpu->mem, 0x6000000, MEM_VRAM_SIZE);
+	mem_add_cache(gpu->mem, 0x7000000, MEM_OAM_SIZE);
+	gpu->thread = thread;
+	return true;
+}
+
+/* the lines of the next frames are drawn in the new format */
+void gpu_set_format(gpu_t *gpu, uint8_t format)
+{
+	if (gpu->format == format)
+		return;
+	gpu_thread_t *thread = gpu->thread;
+	if (thread)
+	{
+		wait_lines(thread);
+		thread->gpu.format = format;
+		memset(thread->gpu.data, 0, GPU_DATA_SIZE);
+	}
+	gpu->format = format;
+	memset(gpu->data, 0, GPU_DATA_SIZE);
+}
+
+void gpu_destroy(gpu_t *gpu)
+{
+	gpu_set_thread(gpu, false);
+}
+
+/* a copy of the instance delta bytes away, it takes the frame of the render thread and draws without it */
+void gpu_rebase(gpu_t *gpu, ptrdiff_t delta)
+{
+	MEM_REBASE(gpu->mem, delta);
+	MEM_REBASE(gpu->data, delta);
+	MEM_REBASE(gpu->tiles, delta);
+	MEM_REBASE(gpu->obj_lines, delta);
+	gpu_thread_t *thread = gpu->thread;
+	if (!thread)
+		return;
+	wait_lines(thread);
+	memcpy(gpu->data, thread->gpu.data, GPU_DATA_SIZE);
+	gpu->thread = NULL;
+	/* the log took the write tracking from the caches */
+	memset(gpu->tiles_valid, 0, sizeof(gpu->tiles_valid));
+	gpu->obj_lines_valid = 0;
+}
+
+/* waits for the lines of the frame, returns the frame */
+const uint8_t *gpu_sync(gpu_t *gpu)
+{
+	gpu_thread_t *thread = gpu->thread;
+	if (!thread)
+		return gpu->data;
+	wait_lines(thread);
+	pthread_mutex_lock(&thread->mutex);
+	thread->lines_nb = 0;
+	thread->lines_drawn = 0;
+	pthread_mutex_unlock(&thread->mutex);
+	thread->pages_nb = 0;
+	return thread->gpu.data;
+}
+
+void gpu_draw(gpu_t *gpu, uint8_t y)
+{
+	uint16_t dispcnt = mem_get_reg16(gpu->mem, MEM_REG_DISPCNT);
+	if ((dispcnt & 0x7) > 5)
+	{
+		printf("invalid mode: %x\n", dispcnt & 0x7);
+		return;
+	}
+	if (gpu->thread)
+		log_line(gpu, y);
+	else
+		draw_line(gpu, y);
 	int16_t bg2pb = mem_get_reg16(gpu->mem, MEM_REG_BG2PB);
 	int16_t bg2pd = mem_get_reg16(gpu->mem, MEM_REG_BG2PD);
 	int16_t bg3pb = mem_get_reg16(gpu->mem, MEM_REG_BG3PB);
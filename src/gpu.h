@@ -1,6 +1,8 @@
 #ifndef GPU_H
 #define GPU_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define TRANSFORM_INT28(n) \
@@ -13,22 +15,45 @@ do \
 	} \
 } while (0)
 
+#define GPU_DATA_SIZE      (240 * 160 * 4)
+#define GPU_TILES_SIZE     (0x18000 * 2)
+#define GPU_OBJ_LINES_SIZE (160 * 128)
+
+/* the frame and the caches live in a separate buffer given to gpu_init, each on its own pages */
+#define GPU_RAM_SIZE (MEM_PAGE_ALIGN(GPU_DATA_SIZE) \
+                    + MEM_PAGE_ALIGN(GPU_TILES_SIZE) \
+                    + MEM_PAGE_ALIGN(GPU_OBJ_LINES_SIZE))
+
 typedef struct mem_s mem_t;
+typedef struct gpu_thread_s gpu_thread_t;
 
 typedef struct gpu_s
 {
-	uint8_t data[240 * 160 * 4];
+	mem_t *mem;
+	gpu_thread_t *thread; /* render thread, lines are only logged when set */
 	int32_t bg2x;
 	int32_t bg2y;
 	int32_t bg3x;
 	int32_t bg3y;
-	mem_t *mem;
+	uint32_t cache_gen; /* mem cache_gen when the caches were last checked */
+	uint8_t tiles_valid[0x18000 >> 8]; /* by mem cache page */
+	uint8_t *tiles; /* 4bpp vram decoded to a palette index per pixel */
+	uint8_t obj_lines_valid;
+	uint8_t obj_lines_hblank; /* DISPCNT hblank interval free bit the lists were bounded with */
+	uint8_t obj_lines_nb[160];
+	uint8_t (*obj_lines)[128]; /* oam index of the objects of each line */
+	uint8_t format; /* enum gba_video_format of data */
+	uint8_t *data;
 } gpu_t;
 
-gpu_t *gpu_new(mem_t *mem);
-void gpu_del(gpu_t *gpu);
+void gpu_init(gpu_t *gpu, mem_t *mem, uint8_t *ram);
+void gpu_rebase(gpu_t *gpu, ptrdiff_t delta);
+void gpu_destroy(gpu_t *gpu);
 
 void gpu_draw(gpu_t *gpu, uint8_t y);
 void gpu_commit_bgpos(gpu_t *gpu);
+bool gpu_set_thread(gpu_t *gpu, bool enabled);
+void gpu_set_format(gpu_t *gpu, uint8_t format);
+const uint8_t *gpu_sync(gpu_t *gpu);
 
 #endif
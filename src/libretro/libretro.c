@@ -17,10 +17,15 @@
 
 #define AUDIO_FRAME (804) /* ceil(AUDIO_FPS / VIDEO_FPS) */
 
+#define TRACE_FILE "emu_gba.trace"
+#define TRACE_SIZE (1 << 20)
+
 static struct retro_log_callback logging;
 static retro_log_printf_t log_cb;
 
 gba_t *g_gba = NULL;
+static bool g_trace = false;
+static enum gba_video_format g_video_format = GBA_VIDEO_XRGB8888;
 
 static void fallback_log(enum retro_log_level level, const char *fmt, ...)
 {
@@ -100,6 +105,52 @@ void retro_set_environment(retro_environment_t cb)
 	};
 
 	cb(RETRO_ENVIRONMENT_SET_CONTROLLER_INFO, (void*)ports);
+
+	static const struct retro_variable variables[] =
+	{
+		{"emu_gba_bios_hle", "BIOS HLE; disabled|enabled"},
+		{"emu_gba_render_thread", "Render thread; disabled|enabled"},
+		{"emu_gba_video_format", "Video format (restart); XRGB8888|RGB565|0RGB1555"},
+		{"emu_gba_profile", "Profile to stderr on unload; disabled|enabled"},
+		{"emu_gba_trace", "Trace to " TRACE_FILE " on unload; disabled|enabled|registers"},
+		{NULL, NULL},
+	};
+
+	cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)variables);
+}
+
+static void check_variables(void)
+{
+	struct retro_variable var = {"emu_gba_bios_hle", NULL};
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+		gba_set_bios_hle(g_gba, !strcmp(var.value, "enabled"));
+
+	var.key = "emu_gba_render_thread";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		if (!gba_set_render_thread(g_gba, !strcmp(var.value, "enabled")))
+			log_cb(RETRO_LOG_ERROR, "can't start render thread\n");
+	}
+
+	var.key = "emu_gba_profile";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		if (!gba_set_profile(g_gba, !strcmp(var.value, "enabled")))
+			log_cb(RETRO_LOG_ERROR, "can't enable profiler\n");
+	}
+
+	var.key = "emu_gba_trace";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		bool regs = !strcmp(var.value, "registers");
+		size_t size = (regs || !strcmp(var.value, "enabled")) ? TRACE_SIZE : 0;
+		g_trace = gba_set_trace(g_gba, size, regs) && size;
+		if (size && !g_trace)
+			log_cb(RETRO_LOG_ERROR, "can't enable trace\n");
+	}
 }
 
 void retro_set_audio_sample(retro_audio_sample_t cb)
@@ -139,6 +190,10 @@ void retro_run(void)
 	int16_t tmp_audio[804];
 	uint32_t joypad = 0;
 
+	bool updated = false;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+		check_variables();
+
 	input_poll_cb();
 
 	joypad |= GBA_BUTTON_LEFT   * (!!input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_LEFT));
@@ -154,7 +209,7 @@ void retro_run(void)
 
 	gba_frame(g_gba, video_buf, tmp_audio, joypad);
 
-	video_cb(video_buf, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_WIDTH * 4);
+	video_cb(video_buf, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_WIDTH * (g_video_format == GBA_VIDEO_XRGB8888 ? 4 : 2));
 
 	for (size_t i = 0; i < AUDIO_FRAME; ++i)
 	{
@@ -169,6 +224,45 @@ void retro_run(void)
 	audio_batch_cb(audio_buf, AUDIO_FRAME);
 }
 
+/* the pixel format can only be set on load, falls back to the other formats when the frontend refuses the option */
+static void set_video_format(void)
+{
+	static const struct
+	{
+		const char *name;
+		enum retro_pixel_format retro;
+		enum gba_video_format gba;
+	} formats[] =
+	{
+		{"XRGB8888", RETRO_PIXEL_FORMAT_XRGB8888, GBA_VIDEO_XRGB8888},
+		{"RGB565",   RETRO_PIXEL_FORMAT_RGB565,   GBA_VIDEO_RGB565  },
+		{"0RGB1555", RETRO_PIXEL_FORMAT_0RGB1555, GBA_VIDEO_0RGB1555},
+	};
+	size_t first = 0;
+	struct retro_variable var = {"emu_gba_video_format", NULL};
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+		{
+			if (!strcmp(var.value, formats[i].name))
+				first = i;
+		}
+	}
+	for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+	{
+		size_t n = (first + i) % (sizeof(formats) / sizeof(*formats));
+		enum retro_pixel_format fmt = formats[n].retro;
+		if (environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+		{
+			g_video_format = formats[n].gba;
+			return;
+		}
+		log_cb(RETRO_LOG_INFO, "%s is not supported.\n", formats[n].name);
+	}
+	/* frontends without the call use 0RGB1555 */
+	g_video_format = GBA_VIDEO_0RGB1555;
+}
+
 bool retro_load_game(const struct retro_game_info *info)
 {
 	struct retro_input_descriptor desc[] =
@@ -188,12 +282,7 @@ bool retro_load_game(const struct retro_game_info *info)
 
 	environ_cb(RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS, desc);
 
-	enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
-	{
-		log_cb(RETRO_LOG_INFO, "XRGB8888 is not supported.\n");
-		return false;
-	}
+	set_video_format();
 
 	if (info->data == NULL || info->size == 0)
 	{
@@ -208,12 +297,35 @@ bool retro_load_game(const struct retro_game_info *info)
 		log_cb(RETRO_LOG_ERROR, "can't create gba\n");
 		return false;
 	}
+	gba_set_video_format(g_gba, g_video_format);
+
+	check_variables();
 
 	return true;
 }
 
+static void save_trace(void)
+{
+	if (!g_trace)
+		return;
+	FILE *fp = fopen(TRACE_FILE, "wb");
+	if (!fp)
+	{
+		log_cb(RETRO_LOG_ERROR, "can't open " TRACE_FILE "\n");
+		return;
+	}
+	if (!gba_save_trace(g_gba, fp))
+		log_cb(RETRO_LOG_ERROR, "can't write " TRACE_FILE "\n");
+	fclose(fp);
+}
+
 void retro_unload_game(void)
 {
+	if (g_gba)
+	{
+		gba_dump_profile(g_gba, stderr, 200);
+		save_trace();
+	}
 	gba_del(g_gba);
 	g_gba = NULL;
 }
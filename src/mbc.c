@@ -4,16 +4,9 @@
 #include <string.h>
 #include <stdio.h>
 
-mbc_t *mbc_new(const void *data, size_t size)
+void mbc_init(mbc_t *mbc, const void *data, size_t size, uint8_t *rom)
 {
-	mbc_t *mbc = calloc(sizeof(*mbc), 1);
-	if (!mbc)
-		return NULL;
-
-	mbc->data = malloc(size);
-	if (!mbc->data)
-		return NULL;
-
+	mbc->data = rom;
 	memcpy(mbc->data, data, size);
 	memset(mbc->backup, 0xff, sizeof(mbc->backup));
 	mbc->data_size = size;
@@ -28,15 +21,11 @@ mbc_t *mbc_new(const void *data, size_t size)
 		mbc->backup_type = MBC_FLASH64;
 	else if (memmem(data, size, "FLASH1M_V", 9))
 		mbc->backup_type = MBC_FLASH128;
-	return mbc;
 }
 
-void mbc_del(mbc_t *mbc)
+void mbc_rebase(mbc_t *mbc, ptrdiff_t delta)
 {
-	if (!mbc)
-		return;
-	free(mbc->data);
-	free(mbc);
+	MEM_REBASE(mbc->data, delta);
 }
 
 #define MBC_GET(size) \
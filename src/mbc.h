@@ -23,8 +23,8 @@ typedef struct mbc_s
 	uint8_t cmdphase;
 } mbc_t;
 
-mbc_t *mbc_new(const void *data, size_t size);
-void mbc_del(mbc_t *mbc);
+void mbc_init(mbc_t *mbc, const void *data, size_t size, uint8_t *rom);
+void mbc_rebase(mbc_t *mbc, ptrdiff_t delta);
 
 uint8_t  mbc_get8 (mbc_t *mbc, uint32_t addr);
 uint16_t mbc_get16(mbc_t *mbc, uint32_t addr);
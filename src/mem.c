@@ -5,6 +5,7 @@
 #include "apu.h"
 #include "gpu.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
@@ -15,33 +16,333 @@ extern uint8_t _binary_gbabios_bin_end;
 
 static uint32_t g_dma_len_max[4] = {0x4000, 0x4000, 0x4000, 0x10000};
 
-mem_t *mem_new(gba_t *gba, mbc_t *mbc)
+static pthread_once_t g_regs_once = PTHREAD_ONCE_INIT;
+
+static void init_regs(void);
+
+static void init_fetch_pages(mem_t *mem)
+{
+	for (uint32_t i = 0; i < MEM_FETCH_PAGES; ++i)
+	{
+		uint32_t addr = i << MEM_FETCH_SHIFT;
+		switch (addr >> 24)
+		{
+			case 0x0:
+				if (addr < MEM_BIOS_SIZE)
+					mem->fetch_pages[i] = &mem->bios[addr];
+				break;
+			case 0x2:
+				mem->fetch_pages[i] = &mem->board_wram[addr & 0x3FFFF];
+				break;
+			case 0x3:
+				mem->fetch_pages[i] = &mem->chip_wram[addr & 0x7FFF];
+				break;
+			case 0x8:
+			case 0x9:
+			case 0xA:
+			case 0xB:
+			case 0xC:
+			case 0xD:
+			{
+				/* partial pages go through mbc_get for open bus */
+				uint32_t a = addr & 0x1FFFFFF;
+				if (a + MEM_FETCH_MASK < mem->mbc->data_size)
+					mem->fetch_pages[i] = &mem->mbc->data[a];
+				break;
+			}
+		}
+	}
+}
+
+static void set_tlb(mem_tlb_t *tlb, uint8_t *data, uint32_t mask, uint32_t limit)
+{
+	tlb->data = data;
+	tlb->mask = mask;
+	tlb->limit = limit;
+}
+
+/* bios (read protection), io, the upper vram mirror, rom open bus and backup stay on the slow path */
+static void init_tlb(mem_t *mem)
+{
+	set_tlb(&mem->tlb_get[0x2], mem->board_wram, 0x3FFFF, MEM_BOARD_WRAM_SIZE);
+	set_tlb(&mem->tlb_set[0x2], mem->board_wram, 0x3FFFF, MEM_BOARD_WRAM_SIZE);
+	set_tlb(&mem->tlb_get[0x3], mem->chip_wram, 0x7FFF, MEM_CHIP_WRAM_SIZE);
+	set_tlb(&mem->tlb_set[0x3], mem->chip_wram, 0x7FFF, MEM_CHIP_WRAM_SIZE);
+	set_tlb(&mem->tlb_get[0x5], mem->palette, 0x3FF, MEM_PALETTE_SIZE);
+	set_tlb(&mem->tlb_set[0x5], mem->palette, 0x3FF, MEM_PALETTE_SIZE);
+	set_tlb(&mem->tlb_get[0x6], mem->vram, 0x1FFFF, MEM_VRAM_SIZE);
+	set_tlb(&mem->tlb_set[0x6], mem->vram, 0x1FFFF, MEM_VRAM_SIZE);
+	set_tlb(&mem->tlb_get[0x7], mem->oam, 0x3FF, MEM_OAM_SIZE);
+	set_tlb(&mem->tlb_set[0x7], mem->oam, 0x3FF, MEM_OAM_SIZE);
+	for (size_t i = 0x8; i < 0xE; ++i)
+		set_tlb(&mem->tlb_get[i], mem->mbc->data, 0x1FFFFFF, mem->mbc->data_size & ~3);
+}
+
+/*
+ * a cache of decoded code or tiles marks the pages it read from; the first
+ * write to such a page drops the mark, flags the page dirty for the cache
+ * to flush its entries there, and bumps cache_gen. unmarked pages are
+ * written without any bookkeeping
+ */
+static uint8_t *cache_region(mem_t *mem, uint32_t addr)
+{
+	switch (addr >> 24)
+	{
+		case 0x2:
+			return mem->cache_pages;
+		case 0x3:
+			return &mem->cache_pages[MEM_CACHE_EWRAM_PAGES];
+		case 0x5:
+			return &mem->cache_pages[MEM_CACHE_EWRAM_PAGES + MEM_CACHE_IWRAM_PAGES + MEM_CACHE_VRAM_PAGES];
+		case 0x6:
+			return &mem->cache_pages[MEM_CACHE_EWRAM_PAGES + MEM_CACHE_IWRAM_PAGES];
+		case 0x7:
+			return &mem->cache_pages[MEM_CACHE_PAGES - MEM_CACHE_OAM_PAGES];
+	}
+	return NULL;
+}
+
+void mem_add_cache(mem_t *mem, uint32_t addr, uint32_t len)
 {
-	mem_t *mem = calloc(sizeof(*mem), 1);
-	if (!mem)
-		return NULL;
+	if (!len)
+		return;
+	uint32_t end = addr + len - 1;
+	for (uint32_t page = addr >> MEM_CACHE_SHIFT; page <= end >> MEM_CACHE_SHIFT; ++page)
+	{
+		uint32_t a = page << MEM_CACHE_SHIFT;
+		uint8_t *marks = cache_region(mem, a);
+		if (!marks)
+			continue;
+		mem_tlb_t *tlb = &mem->tlb_set[a >> 24];
+		marks[(a & tlb->mask) >> MEM_CACHE_SHIFT] = 1;
+		tlb->cache = marks;
+	}
+}
+
+bool mem_take_cache_dirty(mem_t *mem, uint32_t addr)
+{
+	uint8_t *marks = cache_region(mem, addr);
+	if (!marks)
+		return false;
+	size_t page = (marks - mem->cache_pages) + ((addr & mem->tlb_set[addr >> 24].mask) >> MEM_CACHE_SHIFT);
+	uint32_t bit = 1u << (page % 32);
+	if (!(mem->cache_dirty[page / 32] & bit))
+		return false;
+	mem->cache_dirty[page / 32] &= ~bit;
+	return true;
+}
+
+void mem_cache_write(mem_t *mem, const mem_tlb_t *tlb, uint32_t tlb_addr)
+{
+	size_t page = (tlb->cache - mem->cache_pages) + (tlb_addr >> MEM_CACHE_SHIFT);
+	mem->cache_pages[page] = 0;
+	mem->cache_dirty[page / 32] |= 1u << (page % 32);
+	mem->cache_gen++;
+}
+
+/* fold mirrors onto the first copy of each region so watchpoints see every alias */
+static uint32_t unmirror_addr(mem_t *mem, uint32_t addr)
+{
+	uint32_t mask = mem->tlb_get[addr >> 24].mask;
+	if (!mask)
+		return addr;
+	uint32_t a = addr & mask;
+	/* the upper 32k of the vram mirror are a mirror of the object tiles */
+	if ((addr >> 24) == 0x6 && a >= 0x18000)
+		a &= ~0x8000;
+	return (addr & 0xFF000000) | a;
+}
 
-	if (&_binary_gbabios_bin_end - &_binary_gbabios_bin_start != 0x4000)
+/* regions holding a watchpoint lose their tlb entries so every access reaches check_watchpoints */
+static void update_watch_regions(mem_t *mem)
+{
+	memset(mem->watch_regions, 0, sizeof(mem->watch_regions));
+	for (size_t i = 0; i < mem->watchpoints_nb; ++i)
+	{
+		const mem_watch_t *watch = &mem->watchpoints[i];
+		uint32_t end = watch->addr + watch->len - 1;
+		for (uint32_t region = watch->addr >> 24; region <= end >> 24; ++region)
+			mem->watch_regions[region] |= watch->flags;
+	}
+	init_tlb(mem);
+	for (size_t i = 0; i < 0x100; ++i)
+	{
+		if (mem->watch_regions[i] & MEM_WATCH_READ)
+			mem->tlb_get[i].limit = 0;
+		if (mem->watch_regions[i] & MEM_WATCH_WRITE)
+			mem->tlb_set[i].limit = 0;
+	}
+}
+
+bool mem_add_watchpoint(mem_t *mem, uint32_t addr, uint32_t len, uint8_t flags)
+{
+	if (!len || !flags || addr + len - 1 < addr)
+		return false;
+	if (mem->watchpoints_nb == MEM_WATCHPOINTS_MAX)
+		return false;
+	mem_watch_t *watch = &mem->watchpoints[mem->watchpoints_nb++];
+	watch->addr = unmirror_addr(mem, addr);
+	watch->len = len;
+	watch->flags = flags;
+	update_watch_regions(mem);
+	return true;
+}
+
+bool mem_del_watchpoint(mem_t *mem, uint32_t addr)
+{
+	for (size_t i = 0; i < mem->watchpoints_nb; ++i)
+	{
+		if (mem->watchpoints[i].addr != unmirror_addr(mem, addr))
+			continue;
+		mem->watchpoints[i] = mem->watchpoints[--mem->watchpoints_nb];
+		update_watch_regions(mem);
+		return true;
+	}
+	return false;
+}
+
+static void check_watchpoints(mem_t *mem, uint32_t addr, uint32_t len, uint8_t flags)
+{
+	addr = unmirror_addr(mem, addr);
+	for (size_t i = 0; i < mem->watchpoints_nb; ++i)
+	{
+		const mem_watch_t *watch = &mem->watchpoints[i];
+		if (!(watch->flags & flags))
+			continue;
+		if (addr + len <= watch->addr || watch->addr + watch->len <= addr)
+			continue;
+		gba_break(mem->gba, (flags & MEM_WATCH_READ) ? GBA_BREAK_READ : GBA_BREAK_WRITE, addr);
+		return;
+	}
+}
+
+static void set_waits(mem_t *mem, uint8_t region, uint8_t n, uint8_t s, bool prefetch)
+{
+	mem->waits[MEM_WAIT_N16][region] = n;
+	mem->waits[MEM_WAIT_S16][region] = s;
+	mem->waits[MEM_WAIT_N32][region] = n + s + 1;
+	mem->waits[MEM_WAIT_S32][region] = s + s + 1;
+	mem->waits[MEM_WAIT_FETCH_S16][region] = prefetch ? 0 : s;
+	mem->waits[MEM_WAIT_FETCH_S32][region] = prefetch ? 0 : s + s + 1;
+}
+
+/* 32 bits accesses to 16 bits buses take two sequential accesses */
+static void update_waits(mem_t *mem)
+{
+	static const uint8_t n_waits[4] = {4, 3, 2, 8};
+	uint16_t waitcnt = mem_get_reg16(mem, MEM_REG_WAITCNT);
+	bool prefetch = waitcnt & (1 << 14);
+
+	memset(mem->waits, 0, sizeof(mem->waits));
+	set_waits(mem, 0x2, 2, 2, false);
+	for (uint8_t region = 0x5; region <= 0x6; ++region)
+	{
+		mem->waits[MEM_WAIT_N32][region] = 1;
+		mem->waits[MEM_WAIT_S32][region] = 1;
+		mem->waits[MEM_WAIT_FETCH_S32][region] = 1;
+	}
+	for (uint8_t region = 0x8; region <= 0x9; ++region)
+		set_waits(mem, region, n_waits[(waitcnt >> 2) & 3], (waitcnt & (1 << 4)) ? 1 : 2, prefetch);
+	for (uint8_t region = 0xA; region <= 0xB; ++region)
+		set_waits(mem, region, n_waits[(waitcnt >> 5) & 3], (waitcnt & (1 << 7)) ? 1 : 4, prefetch);
+	for (uint8_t region = 0xC; region <= 0xD; ++region)
+		set_waits(mem, region, n_waits[(waitcnt >> 8) & 3], (waitcnt & (1 << 10)) ? 1 : 8, prefetch);
+	for (uint8_t region = 0xE; region <= 0xF; ++region)
+	{
+		/* 8 bits bus: every access is a single non sequential one */
+		uint8_t n = n_waits[waitcnt & 3];
+		for (size_t i = 0; i < MEM_WAIT_LAST; ++i)
+			mem->waits[i][region] = n;
+	}
+}
+
+static uint8_t *alloc_ram(uint8_t **ram, size_t size)
+{
+	uint8_t *data = *ram;
+	*ram += MEM_PAGE_ALIGN(size);
+	return data;
+}
+
+bool mem_init(mem_t *mem, gba_t *gba, mbc_t *mbc, uint8_t *ram)
+{
+	if (&_binary_gbabios_bin_end - &_binary_gbabios_bin_start != MEM_BIOS_SIZE)
 	{
 		fprintf(stderr, "invalid gbabios data: %u\n", (unsigned)(&_binary_gbabios_bin_end - &_binary_gbabios_bin_start));
-		return NULL;
+		return false;
 	}
 
+	mem->board_wram = alloc_ram(&ram, MEM_BOARD_WRAM_SIZE);
+	mem->vram = alloc_ram(&ram, MEM_VRAM_SIZE);
+	mem->chip_wram = alloc_ram(&ram, MEM_CHIP_WRAM_SIZE);
+	mem->bios = alloc_ram(&ram, MEM_BIOS_SIZE);
+	mem->palette = alloc_ram(&ram, MEM_PALETTE_SIZE);
+	mem->oam = alloc_ram(&ram, MEM_OAM_SIZE);
+
 	size_t i = 0;
 	for (uint8_t *s = &_binary_gbabios_bin_start; s < &_binary_gbabios_bin_end; ++s)
 		mem->bios[i++] = *s;
 
 	mem->gba = gba;
 	mem->mbc = mbc;
+	init_fetch_pages(mem);
+	init_tlb(mem);
+	pthread_once(&g_regs_once, init_regs);
+	update_waits(mem);
 	mem_set_reg32(mem, MEM_REG_SOUNDBIAS, 0x200);
-	return mem;
+	return true;
 }
 
-void mem_del(mem_t *mem)
+/*
+ * a copy of the registers and video memories of src for a renderer running
+ * beside the emulation. only palette, vram and oam are mapped, ram holds
+ * MEM_VIDEO_RAM_SIZE bytes
+ */
+void mem_init_video(mem_t *mem, const mem_t *src, uint8_t *ram)
 {
-	if (!mem)
-		return;
-	free(mem);
+	mem->palette = alloc_ram(&ram, MEM_PALETTE_SIZE);
+	mem->vram = alloc_ram(&ram, MEM_VRAM_SIZE);
+	mem->oam = alloc_ram(&ram, MEM_OAM_SIZE);
+	memcpy(mem->io_regs, src->io_regs, sizeof(mem->io_regs));
+	memcpy(mem->palette, src->palette, MEM_PALETTE_SIZE);
+	memcpy(mem->vram, src->vram, MEM_VRAM_SIZE);
+	memcpy(mem->oam, src->oam, MEM_OAM_SIZE);
+	set_tlb(&mem->tlb_get[0x5], mem->palette, 0x3FF, MEM_PALETTE_SIZE);
+	set_tlb(&mem->tlb_set[0x5], mem->palette, 0x3FF, MEM_PALETTE_SIZE);
+	set_tlb(&mem->tlb_get[0x6], mem->vram, 0x1FFFF, MEM_VRAM_SIZE);
+	set_tlb(&mem->tlb_set[0x6], mem->vram, 0x1FFFF, MEM_VRAM_SIZE);
+	set_tlb(&mem->tlb_get[0x7], mem->oam, 0x3FF, MEM_OAM_SIZE);
+	set_tlb(&mem->tlb_set[0x7], mem->oam, 0x3FF, MEM_OAM_SIZE);
+}
+
+void mem_rebase(mem_t *mem, ptrdiff_t delta)
+{
+	MEM_REBASE(mem->gba, delta);
+	MEM_REBASE(mem->mbc, delta);
+	for (size_t i = 0; i < 0x100; ++i)
+	{
+		MEM_REBASE(mem->tlb_get[i].data, delta);
+		MEM_REBASE(mem->tlb_get[i].cache, delta);
+		MEM_REBASE(mem->tlb_set[i].data, delta);
+		MEM_REBASE(mem->tlb_set[i].cache, delta);
+	}
+	for (size_t i = 0; i < MEM_FETCH_PAGES; ++i)
+		MEM_REBASE(mem->fetch_pages[i], delta);
+	MEM_REBASE(mem->bios, delta);
+	MEM_REBASE(mem->board_wram, delta);
+	MEM_REBASE(mem->chip_wram, delta);
+	MEM_REBASE(mem->palette, delta);
+	MEM_REBASE(mem->vram, delta);
+	MEM_REBASE(mem->oam, delta);
+}
+
+/* copies a whole cache page, flagging it for the caches that marked it */
+void mem_set_page(mem_t *mem, uint32_t addr, const uint8_t *data)
+{
+	mem_tlb_t *tlb = &mem->tlb_set[addr >> 24];
+	uint32_t a = addr & tlb->mask & ~((1 << MEM_CACHE_SHIFT) - 1);
+	memcpy(&tlb->data[a], data, 1 << MEM_CACHE_SHIFT);
+	if (tlb->cache && tlb->cache[a >> MEM_CACHE_SHIFT])
+		mem_cache_write(mem, tlb, a);
 }
 
 void mem_timers(mem_t *mem)
@@ -68,7 +369,7 @@ void mem_timers(mem_t *mem)
 		{
 			mem->timers[i].v = mem_get_reg16(mem, MEM_REG_TM0CNT_L + i * 4);
 			if (cnt_h & (1 << 6))
-				mem_set_reg16(mem, MEM_REG_IF, mem_get_reg16(mem, MEM_REG_IF) | (1 << (3 + i)));
+				mem_raise_irq(mem, 1 << (3 + i));
 			uint16_t sndcnt_h = mem_get_reg16(mem, MEM_REG_SOUNDCNT_H);
 			if (i == ((sndcnt_h >> 10) & 1))
 			{
@@ -96,6 +397,20 @@ next_timer:
 	}
 }
 
+void mem_update_irq(mem_t *mem)
+{
+	cpu_t *cpu = mem->gba->cpu;
+	cpu->irq_pending = (mem_get_reg16(mem, MEM_REG_IE) & mem_get_reg16(mem, MEM_REG_IF)) != 0;
+	cpu->irq_master = mem_get_reg16(mem, MEM_REG_IME) != 0;
+	cpu_update_irq(cpu);
+}
+
+void mem_raise_irq(mem_t *mem, uint16_t flags)
+{
+	mem_set_reg16(mem, MEM_REG_IF, mem_get_reg16(mem, MEM_REG_IF) | flags);
+	mem_update_irq(mem);
+}
+
 static void load_dma_length(mem_t *mem, size_t dma)
 {
 	mem->dma[dma].len = mem_get_reg16(mem, MEM_REG_DMA0CNT_L + 0xC * dma);
@@ -167,6 +482,8 @@ bool mem_dma(mem_t *mem)
 	{
 		if (!mem->dma[i].enabled || !mem->dma[i].active)
 			continue;
+		/* a dma unit takes a cycle, its waitstates aren't charged to the cpu */
+		uint32_t waits = mem->wait_cycles;
 		uint16_t cnt_h = mem_get_reg16(mem, MEM_REG_DMA0CNT_H + 0xC * i);
 		if ((i == 1 || i == 2) && (((cnt_h >> 12) & 0x3) == 3))
 		{
@@ -178,6 +495,7 @@ bool mem_dma(mem_t *mem)
 			mem->dma[i].src += 16;
 			mem->fifo_nb[fifo_id] += 16;
 			mem->dma[i].active = false;
+			mem->wait_cycles = waits;
 			return true;
 		}
 		uint32_t step;
@@ -226,8 +544,9 @@ bool mem_dma(mem_t *mem)
 				mem->dma[i].enabled = false;
 			mem_set_reg16(mem, MEM_REG_DMA0CNT_H + 0xC * i, mem_get_reg16(mem, MEM_REG_DMA0CNT_H + 0xC * i) & ~(1 << 15));
 			if (cnt_h & (1 << 14))
-				mem_set_reg16(mem, MEM_REG_IF, mem_get_reg16(mem, MEM_REG_IF) | (1 << (8 + i)));
+				mem_raise_irq(mem, 1 << (8 + i));
 		}
+		mem->wait_cycles = waits;
 		return true;
 	}
 	return false;
@@ -246,358 +565,260 @@ static void dma_control(mem_t *mem, uint8_t dma)
 //		printf("start DMA %d of %08x words from %08x to %08x: %04x\n", dma, mem->dma[dma].len, mem->dma[dma].src, mem->dma[dma].dst, cnt_h);
 }
 
-static void timer_control(mem_t *mem, uint8_t timer, uint8_t v)
+/*
+ * io registers are described byte per byte: a cpu write stores the bits
+ * of write_mask (or calls set), then each distinct effect of the access
+ * is called once, so a full width write only triggers one side effect.
+ * the table is shared by all the instances and only built by the first
+ */
+typedef struct mem_reg_s
+{
+	uint8_t read_mask;
+	uint8_t write_mask;
+	uint8_t (*get)(mem_t *mem, uint32_t reg);
+	void (*set)(mem_t *mem, uint32_t reg, uint8_t v);
+	void (*effect)(mem_t *mem, uint32_t reg);
+} mem_reg_t;
+
+static mem_reg_t g_regs[0x400];
+
+static uint8_t get_timer(mem_t *mem, uint32_t reg)
+{
+	return mem->timers[(reg - MEM_REG_TM0CNT_L) / 4].v >> ((reg & 1) * 8);
+}
+
+static uint8_t get_keyinput(mem_t *mem, uint32_t reg)
 {
-	uint8_t prev = mem_get_reg8(mem, MEM_REG_TM0CNT_H + timer * 4);
-	mem_set_reg8(mem, MEM_REG_TM0CNT_H + timer * 4, v);
+	if (reg == MEM_REG_KEYINPUT + 1)
+	{
+		uint8_t v = 0x3;
+		if (mem->gba->joypad & GBA_BUTTON_R)
+			v &= ~(1 << 0);
+		if (mem->gba->joypad & GBA_BUTTON_L)
+			v &= ~(1 << 1);
+		return v;
+	}
+	uint8_t v = 0xFF;
+	if (mem->gba->joypad & GBA_BUTTON_A)
+		v &= ~(1 << 0);
+	if (mem->gba->joypad & GBA_BUTTON_B)
+		v &= ~(1 << 1);
+	if (mem->gba->joypad & GBA_BUTTON_SELECT)
+		v &= ~(1 << 2);
+	if (mem->gba->joypad & GBA_BUTTON_START)
+		v &= ~(1 << 3);
+	if (mem->gba->joypad & GBA_BUTTON_RIGHT)
+		v &= ~(1 << 4);
+	if (mem->gba->joypad & GBA_BUTTON_LEFT)
+		v &= ~(1 << 5);
+	if (mem->gba->joypad & GBA_BUTTON_UP)
+		v &= ~(1 << 6);
+	if (mem->gba->joypad & GBA_BUTTON_DOWN)
+		v &= ~(1 << 7);
+	return v;
+}
+
+static uint8_t get_wave(mem_t *mem, uint32_t reg)
+{
+	if (mem_get_reg16(mem, MEM_REG_SOUND3CNT_L) & (1 << 6))
+		return mem->wave[reg - MEM_REG_WAVE_RAM0_L];
+	return mem->wave[reg - MEM_REG_WAVE_RAM0_L + 0x10];
+}
+
+static void set_haltcnt(mem_t *mem, uint32_t reg, uint8_t v)
+{
+	(void)reg;
+	if (v & 0x80)
+		mem->gba->cpu->state = CPU_STATE_STOP;
+	else
+		mem->gba->cpu->state = CPU_STATE_HALT;
+}
+
+static void set_if(mem_t *mem, uint32_t reg, uint8_t v)
+{
+	mem->io_regs[reg] &= ~v;
+}
+
+static void set_timer_control(mem_t *mem, uint32_t reg, uint8_t v)
+{
+	uint8_t prev = mem->io_regs[reg];
+	mem->io_regs[reg] = v;
 	if ((v & (1 << 7)) && !(prev & (1 << 7)))
-		mem->timers[timer].v = mem_get_reg16(mem, MEM_REG_TM0CNT_L);
+		mem->timers[(reg - MEM_REG_TM0CNT_H) / 4].v = mem_get_reg16(mem, MEM_REG_TM0CNT_L);
+}
+
+static void set_wave(mem_t *mem, uint32_t reg, uint8_t v)
+{
+	if (mem_get_reg16(mem, MEM_REG_SOUND3CNT_L) & (1 << 6))
+		mem->wave[reg - MEM_REG_WAVE_RAM0_L] = v;
+	else
+		mem->wave[reg - MEM_REG_WAVE_RAM0_L + 0x10] = v;
+}
+
+static void effect_irq(mem_t *mem, uint32_t reg)
+{
+	(void)reg;
+	mem_update_irq(mem);
+}
+
+static void effect_dma(mem_t *mem, uint32_t reg)
+{
+	dma_control(mem, (reg - MEM_REG_DMA0CNT_H) / 0xC);
 }
 
-static void set_reg(mem_t *mem, uint32_t reg, uint8_t v)
+static void effect_keycnt(mem_t *mem, uint32_t reg)
 {
+	(void)reg;
+	gba_test_keypad_int(mem->gba);
+}
+
+static void effect_sound(mem_t *mem, uint32_t reg)
+{
+	if (!(mem->io_regs[reg] & (1 << 7)))
+		return;
 	switch (reg)
 	{
-		case MEM_REG_HALTCNT:
-			if (v & 0x80)
-				mem->gba->cpu->state = CPU_STATE_STOP;
-			else
-				mem->gba->cpu->state = CPU_STATE_HALT;
-			return;
-		case MEM_REG_IF:
-		case MEM_REG_IF + 1:
-			mem->io_regs[reg] &= ~v;
-			return;
-		case MEM_REG_DMA0CNT_H + 1:
-			mem->io_regs[reg] = v;
-			dma_control(mem, 0);
-			return;
-		case MEM_REG_DMA1CNT_H + 1:
-			mem->io_regs[reg] = v;
-			dma_control(mem, 1);
-			return;
-		case MEM_REG_DMA2CNT_H + 1:
-			mem->io_regs[reg] = v;
-			dma_control(mem, 2);
-			return;
-		case MEM_REG_DMA3CNT_H + 1:
-			mem->io_regs[reg] = v;
-			dma_control(mem, 3);
-			return;
-		case MEM_REG_TM0CNT_H:
-			timer_control(mem, 0, v);
-			return;
-		case MEM_REG_TM1CNT_H:
-			timer_control(mem, 1, v);
-			return;
-		case MEM_REG_TM2CNT_H:
-			timer_control(mem, 2, v);
-			return;
-		case MEM_REG_TM3CNT_H:
-			timer_control(mem, 3, v);
-			return;
-		case MEM_REG_KEYINPUT:
-		case MEM_REG_KEYINPUT + 1:
-			return;
-		case MEM_REG_KEYCNT:
-		case MEM_REG_KEYCNT + 1:
-			mem->io_regs[reg] = v;
-			gba_test_keypad_int(mem->gba);
-			return;
 		case MEM_REG_SOUND1CNT_X + 1:
-			mem->io_regs[reg] = v;
-			if (v & (1 << 7))
-				apu_start_channel1(mem->gba->apu);
-			return;
+			apu_start_channel1(mem->gba->apu);
+			break;
 		case MEM_REG_SOUND2CNT_H + 1:
-			mem->io_regs[reg] = v;
-			if (v & (1 << 7))
-				apu_start_channel2(mem->gba->apu);
-			return;
+			apu_start_channel2(mem->gba->apu);
+			break;
 		case MEM_REG_SOUND3CNT_X + 1:
-			mem->io_regs[reg] = v;
-			if (v & (1 << 7))
-				apu_start_channel3(mem->gba->apu);
-			return;
 		case MEM_REG_SOUND4CNT_H + 1:
-			mem->io_regs[reg] = v;
-			if (v & (1 << 7))
-				apu_start_channel3(mem->gba->apu);
-			return;
-		case MEM_REG_WAVE_RAM0_L:
-		case MEM_REG_WAVE_RAM0_L + 1:
-		case MEM_REG_WAVE_RAM0_H:
-		case MEM_REG_WAVE_RAM0_H + 1:
-		case MEM_REG_WAVE_RAM1_L:
-		case MEM_REG_WAVE_RAM1_L + 1:
-		case MEM_REG_WAVE_RAM1_H:
-		case MEM_REG_WAVE_RAM1_H + 1:
-		case MEM_REG_WAVE_RAM2_L:
-		case MEM_REG_WAVE_RAM2_L + 1:
-		case MEM_REG_WAVE_RAM2_H:
-		case MEM_REG_WAVE_RAM2_H + 1:
-		case MEM_REG_WAVE_RAM3_L:
-		case MEM_REG_WAVE_RAM3_L + 1:
-		case MEM_REG_WAVE_RAM3_H:
-		case MEM_REG_WAVE_RAM3_H + 1:
-			if (mem_get_reg16(mem, MEM_REG_SOUND3CNT_L) & (1 << 6))
-				mem->wave[reg - MEM_REG_WAVE_RAM0_L] = v;
-			else
-				mem->wave[reg - MEM_REG_WAVE_RAM0_L + 0x10] = v;
-			return;
-		case MEM_REG_FIFO_A:
-		case MEM_REG_FIFO_A + 1:
-		case MEM_REG_FIFO_A + 2:
-		case MEM_REG_FIFO_A + 3:
-			return;
+			apu_start_channel3(mem->gba->apu);
+			break;
+	}
+}
+
+static void effect_affine(mem_t *mem, uint32_t reg)
+{
+	reg &= ~3;
+	int32_t v = mem_get_reg32(mem, reg) & 0xFFFFFFF;
+	TRANSFORM_INT28(v);
+	switch (reg)
+	{
 		case MEM_REG_BG2X:
-		case MEM_REG_BG2X + 1:
-		case MEM_REG_BG2X + 2:
-		case MEM_REG_BG2X + 3:
-			mem->io_regs[reg] = v;
-			mem->gba->gpu->bg2x = mem_get_reg32(mem, MEM_REG_BG2X) & 0xFFFFFFF;
-			TRANSFORM_INT28(mem->gba->gpu->bg2x);
-			return;
+			mem->gba->gpu->bg2x = v;
+			break;
 		case MEM_REG_BG2Y:
-		case MEM_REG_BG2Y + 1:
-		case MEM_REG_BG2Y + 2:
-		case MEM_REG_BG2Y + 3:
-			mem->io_regs[reg] = v;
-			mem->gba->gpu->bg2y = mem_get_reg32(mem, MEM_REG_BG2Y) & 0xFFFFFFF;
-			TRANSFORM_INT28(mem->gba->gpu->bg2y);
-			return;
-		case MEM_REG_BG3X:
-		case MEM_REG_BG3X + 1:
-		case MEM_REG_BG3X + 2:
-		case MEM_REG_BG3X + 3:
-			mem->io_regs[reg] = v;
-			mem->gba->gpu->bg3x = mem_get_reg32(mem, MEM_REG_BG3X) & 0xFFFFFFF;
-			TRANSFORM_INT28(mem->gba->gpu->bg3x);
-			return;
-		case MEM_REG_BG3Y:
-		case MEM_REG_BG3Y + 1:
-		case MEM_REG_BG3Y + 2:
-		case MEM_REG_BG3Y + 3:
-			mem->io_regs[reg] = v;
-			mem->gba->gpu->bg3y = mem_get_reg32(mem, MEM_REG_BG3Y) & 0xFFFFFFF;
-			TRANSFORM_INT28(mem->gba->gpu->bg3y);
-			return;
-		case MEM_REG_DISPSTAT:
-			mem->io_regs[reg] = (mem->io_regs[reg] & 0x47) | (v & ~0x47);
-			return;
-		case MEM_REG_DISPSTAT + 1:
-			mem->io_regs[reg] = v;
-			return;
-		case MEM_REG_VCOUNT:
-		case MEM_REG_VCOUNT + 1:
+			mem->gba->gpu->bg2y = v;
 			break;
-		case MEM_REG_SOUNDCNT_X:
-			mem->io_regs[reg] = (mem->io_regs[reg] & 0xF) | (v & ~0xF);
-			return;
-		case MEM_REG_WIN0H:
-		case MEM_REG_WIN0H + 1:
-		case MEM_REG_WIN0V:
-		case MEM_REG_WIN0V + 1:
-		case MEM_REG_WIN1H:
-		case MEM_REG_WIN1H + 1:
-		case MEM_REG_WIN1V:
-		case MEM_REG_WIN1V + 1:
-		case MEM_REG_DMA0SAD:
-		case MEM_REG_DMA0SAD + 1:
-		case MEM_REG_DMA0SAD + 2:
-		case MEM_REG_DMA0SAD + 3:
-		case MEM_REG_DMA0DAD:
-		case MEM_REG_DMA0DAD + 1:
-		case MEM_REG_DMA0DAD + 2:
-		case MEM_REG_DMA0DAD + 3:
-		case MEM_REG_DMA0CNT_L:
-		case MEM_REG_DMA0CNT_L + 1:
-		case MEM_REG_DMA1SAD:
-		case MEM_REG_DMA1SAD + 1:
-		case MEM_REG_DMA1SAD + 2:
-		case MEM_REG_DMA1SAD + 3:
-		case MEM_REG_DMA1DAD:
-		case MEM_REG_DMA1DAD + 1:
-		case MEM_REG_DMA1DAD + 2:
-		case MEM_REG_DMA1DAD + 3:
-		case MEM_REG_DMA1CNT_L:
-		case MEM_REG_DMA1CNT_L + 1:
-		case MEM_REG_DMA2SAD:
-		case MEM_REG_DMA2SAD + 1:
-		case MEM_REG_DMA2SAD + 2:
-		case MEM_REG_DMA2SAD + 3:
-		case MEM_REG_DMA2DAD:
-		case MEM_REG_DMA2DAD + 1:
-		case MEM_REG_DMA2DAD + 2:
-		case MEM_REG_DMA2DAD + 3:
-		case MEM_REG_DMA2CNT_L:
-		case MEM_REG_DMA2CNT_L + 1:
-		case MEM_REG_DMA3SAD:
-		case MEM_REG_DMA3SAD + 1:
-		case MEM_REG_DMA3SAD + 2:
-		case MEM_REG_DMA3SAD + 3:
-		case MEM_REG_DMA3DAD:
-		case MEM_REG_DMA3DAD + 1:
-		case MEM_REG_DMA3DAD + 2:
-		case MEM_REG_DMA3DAD + 3:
-		case MEM_REG_DMA3CNT_L:
-		case MEM_REG_DMA3CNT_L  +1:
-		case MEM_REG_DISPCNT:
-		case MEM_REG_DISPCNT + 1:
-		case MEM_REG_BG0CNT:
-		case MEM_REG_BG0CNT + 1:
-		case MEM_REG_BG1CNT:
-		case MEM_REG_BG1CNT + 1:
-		case MEM_REG_BG2CNT:
-		case MEM_REG_BG2CNT + 1:
-		case MEM_REG_BG3CNT:
-		case MEM_REG_BG3CNT + 1:
-		case MEM_REG_BG0HOFS:
-		case MEM_REG_BG0HOFS + 1:
-		case MEM_REG_BG0VOFS:
-		case MEM_REG_BG0VOFS + 1:
-		case MEM_REG_BG1HOFS:
-		case MEM_REG_BG1HOFS + 1:
-		case MEM_REG_BG1VOFS:
-		case MEM_REG_BG1VOFS + 1:
-		case MEM_REG_BG2HOFS:
-		case MEM_REG_BG2HOFS + 1:
-		case MEM_REG_BG2VOFS:
-		case MEM_REG_BG2VOFS + 1:
-		case MEM_REG_BG3HOFS:
-		case MEM_REG_BG3HOFS + 1:
-		case MEM_REG_BG3VOFS:
-		case MEM_REG_BG3VOFS + 1:
-		case MEM_REG_BG2PA:
-		case MEM_REG_BG2PA + 1:
-		case MEM_REG_BG2PB:
-		case MEM_REG_BG2PB + 1:
-		case MEM_REG_BG2PC:
-		case MEM_REG_BG2PC + 1:
-		case MEM_REG_BG2PD:
-		case MEM_REG_BG2PD + 1:
-		case MEM_REG_BG3PA:
-		case MEM_REG_BG3PA + 1:
-		case MEM_REG_BG3PB:
-		case MEM_REG_BG3PB + 1:
-		case MEM_REG_BG3PC:
-		case MEM_REG_BG3PC + 1:
-		case MEM_REG_BG3PD:
-		case MEM_REG_BG3PD + 1:
-		case MEM_REG_IME:
-		case MEM_REG_IME + 1:
-		case MEM_REG_IE:
-		case MEM_REG_IE + 1:
-		case MEM_REG_TM0CNT_L:
-		case MEM_REG_TM0CNT_L + 1:
-		case MEM_REG_TM0CNT_H + 1:
-		case MEM_REG_TM1CNT_L:
-		case MEM_REG_TM1CNT_L + 1:
-		case MEM_REG_TM1CNT_H + 1:
-		case MEM_REG_TM2CNT_L:
-		case MEM_REG_TM2CNT_L + 1:
-		case MEM_REG_TM2CNT_H + 1:
-		case MEM_REG_TM3CNT_L:
-		case MEM_REG_TM3CNT_L + 1:
-		case MEM_REG_TM3CNT_H + 1:
+		case MEM_REG_BG3X:
+			mem->gba->gpu->bg3x = v;
 			break;
-		default:
-			//printf("writing to unknown register [%04x] = %x\n", reg, v);
+		case MEM_REG_BG3Y:
+			mem->gba->gpu->bg3y = v;
 			break;
 	}
-	mem->io_regs[reg] = v;
 }
 
-static void set_reg32(mem_t *mem, uint32_t reg, uint32_t v)
+static void effect_waitcnt(mem_t *mem, uint32_t reg)
 {
-	set_reg(mem, reg + 0, v >> 0);
-	set_reg(mem, reg + 1, v >> 8);
-	set_reg(mem, reg + 2, v >> 16);
-	set_reg(mem, reg + 3, v >> 24);
+	(void)reg;
+	update_waits(mem);
 }
 
-static void set_reg16(mem_t *mem, uint32_t reg, uint16_t v)
+static void init_reg(uint32_t reg, uint32_t size, uint8_t read_mask, uint8_t write_mask)
 {
-	set_reg(mem, reg + 0, v >> 0);
-	set_reg(mem, reg + 1, v >> 8);
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		g_regs[reg + i].read_mask = read_mask;
+		g_regs[reg + i].write_mask = write_mask;
+	}
 }
 
-static void set_reg8(mem_t *mem, uint32_t reg, uint8_t v)
+static void init_regs(void)
 {
-	set_reg(mem, reg, v);
+	init_reg(0, sizeof(g_regs) / sizeof(*g_regs), 0xFF, 0xFF);
+	init_reg(MEM_REG_DISPSTAT, 1, 0xFF, 0xB8);
+	init_reg(MEM_REG_SOUNDCNT_X, 1, 0xFF, 0xF0);
+	init_reg(MEM_REG_FIFO_A, 4, 0x00, 0x00);
+	init_reg(MEM_REG_KEYINPUT, 2, 0xFF, 0x00);
+
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		g_regs[MEM_REG_TM0CNT_L + i * 4 + 0].get = get_timer;
+		g_regs[MEM_REG_TM0CNT_L + i * 4 + 1].get = get_timer;
+		g_regs[MEM_REG_TM0CNT_H + i * 4].set = set_timer_control;
+		g_regs[MEM_REG_DMA0CNT_H + 0xC * i + 1].effect = effect_dma;
+	}
+	g_regs[MEM_REG_KEYINPUT + 0].get = get_keyinput;
+	g_regs[MEM_REG_KEYINPUT + 1].get = get_keyinput;
+	for (uint32_t i = 0; i < 0x10; ++i)
+	{
+		g_regs[MEM_REG_WAVE_RAM0_L + i].get = get_wave;
+		g_regs[MEM_REG_WAVE_RAM0_L + i].set = set_wave;
+	}
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		g_regs[MEM_REG_BG2X + i].effect = effect_affine;
+		g_regs[MEM_REG_BG2Y + i].effect = effect_affine;
+		g_regs[MEM_REG_BG3X + i].effect = effect_affine;
+		g_regs[MEM_REG_BG3Y + i].effect = effect_affine;
+	}
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		g_regs[MEM_REG_IE + i].effect = effect_irq;
+		g_regs[MEM_REG_IF + i].set = set_if;
+		g_regs[MEM_REG_IF + i].effect = effect_irq;
+		g_regs[MEM_REG_IME + i].effect = effect_irq;
+		g_regs[MEM_REG_KEYCNT + i].effect = effect_keycnt;
+	}
+	g_regs[MEM_REG_SOUND1CNT_X + 1].effect = effect_sound;
+	g_regs[MEM_REG_SOUND2CNT_H + 1].effect = effect_sound;
+	g_regs[MEM_REG_SOUND3CNT_X + 1].effect = effect_sound;
+	g_regs[MEM_REG_SOUND4CNT_H + 1].effect = effect_sound;
+	g_regs[MEM_REG_WAITCNT + 0].effect = effect_waitcnt;
+	g_regs[MEM_REG_WAITCNT + 1].effect = effect_waitcnt;
+	g_regs[MEM_REG_HALTCNT].set = set_haltcnt;
 }
 
-static uint8_t get_reg(mem_t *mem, uint32_t reg)
+static void set_reg(mem_t *mem, uint32_t reg, uint32_t v, uint8_t bytes)
 {
-	switch (reg)
+	void (*effects[4])(mem_t *mem, uint32_t reg);
+	uint32_t effects_reg[4];
+	uint8_t effects_nb = 0;
+	for (uint8_t i = 0; i < bytes; ++i)
 	{
-		case MEM_REG_TM0CNT_L:
-			return mem->timers[0].v;
-		case MEM_REG_TM0CNT_L + 1:
-			return mem->timers[0].v >> 8;
-		case MEM_REG_TM1CNT_L:
-			return mem->timers[1].v;
-		case MEM_REG_TM1CNT_L + 1:
-			return mem->timers[1].v >> 8;
-		case MEM_REG_TM2CNT_L:
-			return mem->timers[2].v;
-		case MEM_REG_TM2CNT_L + 1:
-			return mem->timers[2].v >> 8;
-		case MEM_REG_TM3CNT_L:
-			return mem->timers[3].v;
-		case MEM_REG_TM3CNT_L + 1:
-			return mem->timers[3].v >> 8;
-		case MEM_REG_KEYINPUT:
-		{
-			uint8_t v = 0xFF;
-			if (mem->gba->joypad & GBA_BUTTON_A)
-				v &= ~(1 << 0);
-			if (mem->gba->joypad & GBA_BUTTON_B)
-				v &= ~(1 << 1);
-			if (mem->gba->joypad & GBA_BUTTON_SELECT)
-				v &= ~(1 << 2);
-			if (mem->gba->joypad & GBA_BUTTON_START)
-				v &= ~(1 << 3);
-			if (mem->gba->joypad & GBA_BUTTON_RIGHT)
-				v &= ~(1 << 4);
-			if (mem->gba->joypad & GBA_BUTTON_LEFT)
-				v &= ~(1 << 5);
-			if (mem->gba->joypad & GBA_BUTTON_UP)
-				v &= ~(1 << 6);
-			if (mem->gba->joypad & GBA_BUTTON_DOWN)
-				v &= ~(1 << 7);
-			return v;
-		}
-		case MEM_REG_KEYINPUT + 1:
+		const mem_reg_t *desc = &g_regs[reg + i];
+		uint8_t b = v >> (i * 8);
+		if (desc->set)
+			desc->set(mem, reg + i, b);
+		else
+			mem->io_regs[reg + i] = (mem->io_regs[reg + i] & ~desc->write_mask) | (b & desc->write_mask);
+		if (desc->effect && (!effects_nb || effects[effects_nb - 1] != desc->effect))
 		{
-			uint8_t v = 0x3;
-			if (mem->gba->joypad & GBA_BUTTON_R)
-				v &= ~(1 << 0);
-			if (mem->gba->joypad & GBA_BUTTON_L)
-				v &= ~(1 << 1);
-			return v;
+			effects[effects_nb] = desc->effect;
+			effects_reg[effects_nb] = reg + i;
+			effects_nb++;
 		}
-		case MEM_REG_WAVE_RAM0_L:
-		case MEM_REG_WAVE_RAM0_L + 1:
-		case MEM_REG_WAVE_RAM0_H:
-		case MEM_REG_WAVE_RAM0_H + 1:
-		case MEM_REG_WAVE_RAM1_L:
-		case MEM_REG_WAVE_RAM1_L + 1:
-		case MEM_REG_WAVE_RAM1_H:
-		case MEM_REG_WAVE_RAM1_H + 1:
-		case MEM_REG_WAVE_RAM2_L:
-		case MEM_REG_WAVE_RAM2_L + 1:
-		case MEM_REG_WAVE_RAM2_H:
-		case MEM_REG_WAVE_RAM2_H + 1:
-		case MEM_REG_WAVE_RAM3_L:
-		case MEM_REG_WAVE_RAM3_L + 1:
-		case MEM_REG_WAVE_RAM3_H:
-		case MEM_REG_WAVE_RAM3_H + 1:
-			if (mem_get_reg16(mem, MEM_REG_SOUND3CNT_L) & (1 << 6))
-				return mem->wave[reg - MEM_REG_WAVE_RAM0_L];
-			return mem->wave[reg - MEM_REG_WAVE_RAM0_L + 0x10];
 	}
-	return mem->io_regs[reg];
+	for (uint8_t i = 0; i < effects_nb; ++i)
+		effects[i](mem, effects_reg[i]);
+}
+
+static void set_reg32(mem_t *mem, uint32_t reg, uint32_t v)
+{
+	set_reg(mem, reg, v, 4);
+}
+
+static void set_reg16(mem_t *mem, uint32_t reg, uint16_t v)
+{
+	set_reg(mem, reg, v, 2);
+}
+
+static void set_reg8(mem_t *mem, uint32_t reg, uint8_t v)
+{
+	set_reg(mem, reg, v, 1);
+}
+
+static uint8_t get_reg(mem_t *mem, uint32_t reg)
+{
+	const mem_reg_t *desc = &g_regs[reg];
+	if (desc->get)
+		return desc->get(mem, reg) & desc->read_mask;
+	return mem->io_regs[reg] & desc->read_mask;
 }
 
 static uint32_t get_reg32(mem_t *mem, uint32_t reg)
@@ -619,13 +840,10 @@ static uint8_t get_reg8(mem_t *mem, uint32_t reg)
 	return get_reg(mem, reg);
 }
 
-#define MEM_GET(size) \
-uint##size##_t mem_get##size(mem_t *mem, uint32_t addr) \
+/* the reads missing the tlb, without waitstates nor watchpoints */
+#define MEM_READ(size) \
+static uint##size##_t read##size(mem_t *mem, uint32_t addr) \
 { \
-	if (size == 16) \
-		addr &= ~1; \
-	if (size == 32) \
-		addr &= ~3; \
 	if (addr >= 0x10000000) \
 		goto end; \
 	switch ((addr >> 24) & 0xF) \
@@ -687,10 +905,45 @@ end: \
 	return 0; \
 }
 
+MEM_READ(8);
+MEM_READ(16);
+MEM_READ(32);
+
+#define MEM_GET(size) \
+uint##size##_t mem_get##size(mem_t *mem, uint32_t addr) \
+{ \
+	if (size == 16) \
+		addr &= ~1; \
+	if (size == 32) \
+		addr &= ~3; \
+	mem->wait_cycles += mem->waits[size == 32 ? MEM_WAIT_N32 : MEM_WAIT_N16][addr >> 24]; \
+	const mem_tlb_t *tlb = &mem->tlb_get[addr >> 24]; \
+	uint32_t tlb_addr = addr & tlb->mask; \
+	if (tlb_addr < tlb->limit) \
+		return *(uint##size##_t*)&tlb->data[tlb_addr]; \
+	if (mem->watch_regions[addr >> 24] & MEM_WATCH_READ) \
+		check_watchpoints(mem, addr, size / 8, MEM_WATCH_READ); \
+	return read##size(mem, addr); \
+}
+
 MEM_GET(8);
 MEM_GET(16);
 MEM_GET(32);
 
+/* instruction fetches outside of the fetch pages: the fetch already took its waitstates and doesn't trip the read watchpoints */
+#define MEM_FETCH_SLOW(size) \
+uint##size##_t mem_fetch_slow##size(mem_t *mem, uint32_t addr) \
+{ \
+	const mem_tlb_t *tlb = &mem->tlb_get[addr >> 24]; \
+	uint32_t tlb_addr = addr & tlb->mask; \
+	if (tlb_addr < tlb->limit) \
+		return *(uint##size##_t*)&tlb->data[tlb_addr]; \
+	return read##size(mem, addr); \
+}
+
+MEM_FETCH_SLOW(16);
+MEM_FETCH_SLOW(32);
+
 #define MEM_SET(size) \
 void mem_set##size(mem_t *mem, uint32_t addr, uint##size##_t v) \
 { \
@@ -698,6 +951,18 @@ void mem_set##size(mem_t *mem, uint32_t addr, uint##size##_t v) \
 		addr &= ~1; \
 	if (size == 32) \
 		addr &= ~3; \
+	mem->wait_cycles += mem->waits[size == 32 ? MEM_WAIT_N32 : MEM_WAIT_N16][addr >> 24]; \
+	const mem_tlb_t *tlb = &mem->tlb_set[addr >> 24]; \
+	uint32_t tlb_addr = addr & tlb->mask; \
+	if (tlb_addr < tlb->limit) \
+	{ \
+		*(uint##size##_t*)&tlb->data[tlb_addr] = v; \
+		if (tlb->cache && tlb->cache[tlb_addr >> MEM_CACHE_SHIFT]) \
+			mem_cache_write(mem, tlb, tlb_addr); \
+		return; \
+	} \
+	if (mem->watch_regions[addr >> 24] & MEM_WATCH_WRITE) \
+		check_watchpoints(mem, addr, size / 8, MEM_WATCH_WRITE); \
 	switch ((addr >> 24) & 0xF) \
 	{ \
 		case 0x0: /* bios */ \
@@ -708,12 +973,18 @@ void mem_set##size(mem_t *mem, uint32_t addr, uint##size##_t v) \
 		{ \
 			uint32_t a = addr & 0x3FFFF; \
 			*(uint##size##_t*)&mem->board_wram[a] = v; \
+			tlb = &mem->tlb_set[0x2]; \
+			if (tlb->cache && tlb->cache[a >> MEM_CACHE_SHIFT]) \
+				mem_cache_write(mem, tlb, a); \
 			return; \
 		} \
 		case 0x3: /* chip wram */ \
 		{ \
 			uint32_t a = addr & 0x7FFF; \
 			*(uint##size##_t*)&mem->chip_wram[a] = v; \
+			tlb = &mem->tlb_set[0x3]; \
+			if (tlb->cache && tlb->cache[a >> MEM_CACHE_SHIFT]) \
+				mem_cache_write(mem, tlb, a); \
 			return; \
 		} \
 		case 0x4: /* registers */ \
@@ -726,6 +997,9 @@ void mem_set##size(mem_t *mem, uint32_t addr, uint##size##_t v) \
 		{ \
 			uint32_t a = addr & 0x3FF; \
 			*(uint##size##_t*)&mem->palette[a] = v; \
+			tlb = &mem->tlb_set[0x5]; \
+			if (tlb->cache && tlb->cache[a >> MEM_CACHE_SHIFT]) \
+				mem_cache_write(mem, tlb, a); \
 			return; \
 		} \
 		case 0x6: /* vram */ \
@@ -734,12 +1008,18 @@ void mem_set##size(mem_t *mem, uint32_t addr, uint##size##_t v) \
 			if (a >= 0x18000) \
 				a &= ~0x8000; \
 			*(uint##size##_t*)&mem->vram[a] = v; \
+			tlb = &mem->tlb_set[0x6]; \
+			if (tlb->cache && tlb->cache[a >> MEM_CACHE_SHIFT]) \
+				mem_cache_write(mem, tlb, a); \
 			return; \
 		} \
 		case 0x7: /* oam */ \
 		{ \
 			uint32_t a = addr & 0x3FF; \
 			*(uint##size##_t*)&mem->oam[a] = v; \
+			tlb = &mem->tlb_set[0x7]; \
+			if (tlb->cache && tlb->cache[a >> MEM_CACHE_SHIFT]) \
+				mem_cache_write(mem, tlb, a); \
 			return; \
 		} \
 		case 0x8: \
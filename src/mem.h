@@ -2,6 +2,7 @@
 #define MEM_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define MEM_REG_DISPCNT     0x000
@@ -121,6 +122,34 @@
 typedef struct mbc_s mbc_t;
 typedef struct gba_s gba_t;
 
+#define MEM_BIOS_SIZE       0x4000
+#define MEM_BOARD_WRAM_SIZE 0x40000
+#define MEM_CHIP_WRAM_SIZE  0x8000
+#define MEM_PALETTE_SIZE    0x400
+#define MEM_VRAM_SIZE       0x18000
+#define MEM_OAM_SIZE        0x400
+
+/* the memories live in a separate buffer given to mem_init, each on its own pages */
+#define MEM_PAGE_SIZE 0x1000
+#define MEM_PAGE_ALIGN(n) (((n) + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1))
+#define MEM_RAM_SIZE (MEM_PAGE_ALIGN(MEM_BOARD_WRAM_SIZE) \
+                    + MEM_PAGE_ALIGN(MEM_VRAM_SIZE) \
+                    + MEM_PAGE_ALIGN(MEM_CHIP_WRAM_SIZE) \
+                    + MEM_PAGE_ALIGN(MEM_BIOS_SIZE) \
+                    + MEM_PAGE_ALIGN(MEM_PALETTE_SIZE) \
+                    + MEM_PAGE_ALIGN(MEM_OAM_SIZE))
+#define MEM_VIDEO_RAM_SIZE (MEM_PAGE_ALIGN(MEM_PALETTE_SIZE) \
+                          + MEM_PAGE_ALIGN(MEM_VRAM_SIZE) \
+                          + MEM_PAGE_ALIGN(MEM_OAM_SIZE))
+
+/* moves a pointer into an instance to the same place in a copy of it delta bytes away */
+#define MEM_REBASE(p, delta) \
+do \
+{ \
+	if (p) \
+		(p) = (void*)((uintptr_t)(p) + (delta)); \
+} while (0)
+
 typedef struct mem_dma_s
 {
 	bool enabled;
@@ -136,36 +165,106 @@ typedef struct mem_timer_s
 	uint16_t v;
 } mem_timer_t;
 
+/* opcode fetch pages: host pointers for bios, wram and rom, NULL uses the slow path */
+#define MEM_FETCH_SHIFT 14
+#define MEM_FETCH_MASK  ((1 << MEM_FETCH_SHIFT) - 1)
+#define MEM_FETCH_END   0x0E000000
+#define MEM_FETCH_PAGES (MEM_FETCH_END >> MEM_FETCH_SHIFT)
+
+/* data access map indexed by addr >> 24: masked offsets below limit are plain memory */
+typedef struct mem_tlb_s
+{
+	uint8_t *data;
+	uint8_t *cache; /* cache page marks of the region, NULL until a page holds cached data */
+	uint32_t mask;
+	uint32_t limit;
+} mem_tlb_t;
+
+/* write tracking of cached code in ewram and iwram and of the gpu caches of vram, palette and oam, by 256 bytes pages */
+#define MEM_CACHE_SHIFT 8
+#define MEM_CACHE_EWRAM_PAGES (MEM_BOARD_WRAM_SIZE >> MEM_CACHE_SHIFT)
+#define MEM_CACHE_IWRAM_PAGES (MEM_CHIP_WRAM_SIZE >> MEM_CACHE_SHIFT)
+#define MEM_CACHE_VRAM_PAGES  (MEM_VRAM_SIZE >> MEM_CACHE_SHIFT)
+#define MEM_CACHE_PALETTE_PAGES (MEM_PALETTE_SIZE >> MEM_CACHE_SHIFT)
+#define MEM_CACHE_OAM_PAGES   (MEM_OAM_SIZE >> MEM_CACHE_SHIFT)
+#define MEM_CACHE_PAGES (MEM_CACHE_EWRAM_PAGES + MEM_CACHE_IWRAM_PAGES + MEM_CACHE_VRAM_PAGES + MEM_CACHE_PALETTE_PAGES + MEM_CACHE_OAM_PAGES)
+
+/* waitstates added to each access, by addr >> 24 */
+enum mem_wait
+{
+	MEM_WAIT_N16,
+	MEM_WAIT_S16,
+	MEM_WAIT_N32,
+	MEM_WAIT_S32,
+	MEM_WAIT_FETCH_S16, /* sequential opcode fetches, hidden by the prefetch buffer when enabled */
+	MEM_WAIT_FETCH_S32,
+	MEM_WAIT_LAST
+};
+
+#define MEM_WATCH_READ  (1 << 0)
+#define MEM_WATCH_WRITE (1 << 1)
+#define MEM_WATCHPOINTS_MAX 16
+
+typedef struct mem_watch_s
+{
+	uint32_t addr;
+	uint32_t len;
+	uint8_t flags;
+} mem_watch_t;
+
 typedef struct mem_s
 {
 	gba_t *gba;
 	mbc_t *mbc;
+	uint32_t wait_cycles; /* waitstates of the accesses since the last mem_take_waits */
+	uint32_t fetch_next;
 	mem_timer_t timers[4];
 	mem_dma_t dma[4];
-	uint8_t bios[0x4000];
-	uint8_t board_wram[0x40000];
-	uint8_t chip_wram[0x8000];
 	uint8_t io_regs[0x400];
-	uint8_t palette[0x400];
-	uint8_t vram[0x18000];
-	uint8_t oam[0x400];
+	uint8_t waits[MEM_WAIT_LAST][0x100]; /* rebuilt on WAITCNT writes */
+	mem_tlb_t tlb_get[0x100];
+	mem_tlb_t tlb_set[0x100];
+	uint8_t watch_regions[0x100]; /* MEM_WATCH_* of the watchpoints in each tlb region, kept off the tlb */
+	uint8_t *fetch_pages[MEM_FETCH_PAGES];
+	uint8_t *bios;
+	uint8_t *board_wram;
+	uint8_t *chip_wram;
+	uint8_t *palette;
+	uint8_t *vram;
+	uint8_t *oam;
 	uint8_t wave[0x20];
 	uint8_t fifo[2][0x20];
 	uint8_t fifo_nb[2];
+	mem_watch_t watchpoints[MEM_WATCHPOINTS_MAX];
+	uint8_t watchpoints_nb;
+	uint8_t cache_pages[MEM_CACHE_PAGES];
+	uint32_t cache_dirty[(MEM_CACHE_PAGES + 31) / 32];
+	uint32_t cache_gen; /* incremented on each cache page invalidation */
 } mem_t;
 
-mem_t *mem_new(gba_t *gba, mbc_t *mbc);
-void mem_del(mem_t *mem);
+bool mem_init(mem_t *mem, gba_t *gba, mbc_t *mbc, uint8_t *ram);
+void mem_init_video(mem_t *mem, const mem_t *src, uint8_t *ram);
+void mem_rebase(mem_t *mem, ptrdiff_t delta);
 
 void mem_timers(mem_t *mem);
 bool mem_dma(mem_t *mem);
 void mem_hblank(mem_t *mem);
 void mem_vblank(mem_t *mem);
 void mem_fifo(mem_t *mem, uint8_t fifo);
+void mem_raise_irq(mem_t *mem, uint16_t flags);
+void mem_update_irq(mem_t *mem);
+bool mem_add_watchpoint(mem_t *mem, uint32_t addr, uint32_t len, uint8_t flags);
+bool mem_del_watchpoint(mem_t *mem, uint32_t addr);
+void mem_add_cache(mem_t *mem, uint32_t addr, uint32_t len);
+bool mem_take_cache_dirty(mem_t *mem, uint32_t addr);
+void mem_cache_write(mem_t *mem, const mem_tlb_t *tlb, uint32_t tlb_addr);
+void mem_set_page(mem_t *mem, uint32_t addr, const uint8_t *data);
 
 uint8_t  mem_get8 (mem_t *mem, uint32_t addr);
 uint16_t mem_get16(mem_t *mem, uint32_t addr);
 uint32_t mem_get32(mem_t *mem, uint32_t addr);
+uint16_t mem_fetch_slow16(mem_t *mem, uint32_t addr);
+uint32_t mem_fetch_slow32(mem_t *mem, uint32_t addr);
 void mem_set8 (mem_t *mem, uint32_t addr, uint8_t val);
 void mem_set16(mem_t *mem, uint32_t addr, uint16_t val);
 void mem_set32(mem_t *mem, uint32_t addr, uint32_t val);
@@ -200,6 +299,84 @@ static inline void mem_set_reg8(mem_t *mem, uint32_t reg, uint8_t v)
 	mem->io_regs[reg] = v;
 }
 
+static inline uint32_t mem_take_waits(mem_t *mem)
+{
+	uint32_t waits = mem->wait_cycles;
+	mem->wait_cycles = 0;
+	return waits;
+}
+
+/* a block access is one non sequential word followed by sequential ones */
+static inline void mem_block_waits(mem_t *mem, uint32_t addr, uint32_t size)
+{
+	uint32_t region = addr >> 24;
+	mem->wait_cycles += mem->waits[MEM_WAIT_N32][region] + mem->waits[MEM_WAIT_S32][region] * (size / 4 - 1);
+}
+
+static inline uint8_t *mem_tlb_block(const mem_tlb_t *tlb, uint32_t addr, uint32_t size)
+{
+	uint32_t a = addr & tlb->mask;
+	if (a + size > tlb->limit)
+		return NULL;
+	return &tlb->data[a];
+}
+
+/* host pointer to a plain memory range, NULL if any part of it needs the slow path */
+static inline uint8_t *mem_get_block(mem_t *mem, uint32_t addr, uint32_t size)
+{
+	uint8_t *block = mem_tlb_block(&mem->tlb_get[addr >> 24], addr, size);
+	if (block)
+		mem_block_waits(mem, addr, size);
+	return block;
+}
+
+static inline uint8_t *mem_set_block(mem_t *mem, uint32_t addr, uint32_t size)
+{
+	const mem_tlb_t *tlb = &mem->tlb_set[addr >> 24];
+	uint8_t *block = mem_tlb_block(tlb, addr, size);
+	if (block && tlb->cache)
+	{
+		/* writes over cached pages go through mem_set* to invalidate them */
+		uint32_t a = addr & tlb->mask;
+		for (uint32_t page = a >> MEM_CACHE_SHIFT; page <= (a + size - 1) >> MEM_CACHE_SHIFT; ++page)
+		{
+			if (tlb->cache[page])
+				return NULL;
+		}
+	}
+	if (block)
+		mem_block_waits(mem, addr, size);
+	return block;
+}
+
+static inline uint16_t mem_fetch16(mem_t *mem, uint32_t addr)
+{
+	addr &= ~1;
+	mem->wait_cycles += mem->waits[addr == mem->fetch_next ? MEM_WAIT_FETCH_S16 : MEM_WAIT_N16][addr >> 24];
+	mem->fetch_next = addr + 2;
+	if (addr < MEM_FETCH_END)
+	{
+		uint8_t *page = mem->fetch_pages[addr >> MEM_FETCH_SHIFT];
+		if (page)
+			return *(uint16_t*)&page[addr & MEM_FETCH_MASK];
+	}
+	return mem_fetch_slow16(mem, addr);
+}
+
+static inline uint32_t mem_fetch32(mem_t *mem, uint32_t addr)
+{
+	addr &= ~3;
+	mem->wait_cycles += mem->waits[addr == mem->fetch_next ? MEM_WAIT_FETCH_S32 : MEM_WAIT_N32][addr >> 24];
+	mem->fetch_next = addr + 4;
+	if (addr < MEM_FETCH_END)
+	{
+		uint8_t *page = mem->fetch_pages[addr >> MEM_FETCH_SHIFT];
+		if (page)
+			return *(uint32_t*)&page[addr & MEM_FETCH_MASK];
+	}
+	return mem_fetch_slow32(mem, addr);
+}
+
 static inline uint16_t mem_get_oam16(mem_t *mem, uint32_t addr)
 {
 	return *(uint16_t*)&mem->oam[addr];
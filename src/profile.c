@@ -0,0 +1,139 @@
+#include "profile.h"
+#include "cpu/instr.h"
+#include "cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_EMPTY 0xFFFFFFFF
+
+profile_t *profile_new(void)
+{
+	profile_t *profile = calloc(sizeof(*profile), 1);
+	if (!profile)
+		return NULL;
+
+	profile->size = 0x1000;
+	profile->entries = malloc(sizeof(*profile->entries) * profile->size);
+	if (!profile->entries)
+	{
+		free(profile);
+		return NULL;
+	}
+	for (size_t i = 0; i < profile->size; ++i)
+		profile->entries[i].key = PROFILE_EMPTY;
+	return profile;
+}
+
+void profile_del(profile_t *profile)
+{
+	if (!profile)
+		return;
+	free(profile->entries);
+	free(profile);
+}
+
+static profile_entry_t *find_entry(profile_entry_t *entries, size_t size, uint32_t key)
+{
+	size_t i = (key * 0x9E3779B1u) & (size - 1);
+	while (entries[i].key != key && entries[i].key != PROFILE_EMPTY)
+		i = (i + 1) & (size - 1);
+	return &entries[i];
+}
+
+static bool grow(profile_t *profile)
+{
+	size_t size = profile->size * 2;
+	profile_entry_t *entries = malloc(sizeof(*entries) * size);
+	if (!entries)
+		return false;
+	for (size_t i = 0; i < size; ++i)
+		entries[i].key = PROFILE_EMPTY;
+	for (size_t i = 0; i < profile->size; ++i)
+	{
+		if (profile->entries[i].key == PROFILE_EMPTY)
+			continue;
+		*find_entry(entries, size, profile->entries[i].key) = profile->entries[i];
+	}
+	free(profile->entries);
+	profile->entries = entries;
+	profile->size = size;
+	return true;
+}
+
+void profile_add(profile_t *profile, uint32_t pc, bool thumb, uint32_t opcode, const cpu_instr_t *instr, uint32_t cycles)
+{
+	uint32_t key = pc | thumb;
+	profile_entry_t *entry = find_entry(profile->entries, profile->size, key);
+	if (entry->key == PROFILE_EMPTY)
+	{
+		if (profile->count * 2 >= profile->size)
+		{
+			if (!grow(profile))
+				return;
+			entry = find_entry(profile->entries, profile->size, key);
+		}
+		entry->key = key;
+		entry->count = 0;
+		entry->cycles = 0;
+		profile->count++;
+	}
+	entry->opcode = opcode;
+	entry->instr = instr;
+	entry->count++;
+	entry->cycles += cycles;
+	profile->total_cycles += cycles;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const profile_entry_t *ea = a;
+	const profile_entry_t *eb = b;
+	if (ea->cycles != eb->cycles)
+		return ea->cycles < eb->cycles ? 1 : -1;
+	return ea->key < eb->key ? -1 : 1;
+}
+
+void profile_dump(profile_t *profile, cpu_t *cpu, FILE *fp, size_t max)
+{
+	profile_entry_t *sorted = malloc(sizeof(*sorted) * (profile->count ? profile->count : 1));
+	if (!sorted)
+		return;
+	size_t n = 0;
+	for (size_t i = 0; i < profile->size; ++i)
+	{
+		if (profile->entries[i].key != PROFILE_EMPTY)
+			sorted[n++] = profile->entries[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_entries);
+	if (max && n > max)
+		n = max;
+
+	/* print callbacks decode cpu->instr_opcode and may touch the registers */
+	uint32_t opcode = cpu->instr_opcode;
+	cpu_regs_t regs = cpu->regs;
+	fprintf(fp, "%12s %6s %10s %-8s %-8s instr\n", "cycles", "%", "count", "pc", "opcode");
+	for (size_t i = 0; i < n; ++i)
+	{
+		const profile_entry_t *entry = &sorted[i];
+		char tmp[1024] = "";
+		if (entry->instr && entry->instr->print)
+		{
+			cpu->instr_opcode = entry->opcode;
+			entry->instr->print(cpu, tmp, sizeof(tmp));
+		}
+		fprintf(fp, "%12llu %6.2f %10llu %08x %0*x%*s %s\n",
+		        (unsigned long long)entry->cycles,
+		        profile->total_cycles ? entry->cycles * 100. / profile->total_cycles : 0.,
+		        (unsigned long long)entry->count,
+		        entry->key & ~1u,
+		        (entry->key & 1) ? 4 : 8,
+		        entry->opcode,
+		        (entry->key & 1) ? 4 : 0,
+		        "",
+		        tmp);
+	}
+	cpu->instr_opcode = opcode;
+	cpu->regs = regs;
+	free(sorted);
+}
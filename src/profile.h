@@ -0,0 +1,35 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct cpu_instr_s cpu_instr_t;
+typedef struct cpu_s cpu_t;
+
+typedef struct profile_entry_s
+{
+	uint32_t key; /* pc | thumb */
+	uint32_t opcode;
+	const cpu_instr_t *instr;
+	uint64_t count;
+	uint64_t cycles;
+} profile_entry_t;
+
+typedef struct profile_s
+{
+	profile_entry_t *entries;
+	size_t size;
+	size_t count;
+	uint64_t total_cycles;
+} profile_t;
+
+profile_t *profile_new(void);
+void profile_del(profile_t *profile);
+
+void profile_add(profile_t *profile, uint32_t pc, bool thumb, uint32_t opcode, const cpu_instr_t *instr, uint32_t cycles);
+void profile_dump(profile_t *profile, cpu_t *cpu, FILE *fp, size_t max);
+
+#endif
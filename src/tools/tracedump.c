@@ -0,0 +1,26 @@
+#include "../trace.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "%s trace_file\n", argv[0]);
+		return 1;
+	}
+	FILE *fp = fopen(argv[1], "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "can't open %s\n", argv[1]);
+		return 1;
+	}
+	bool ret = trace_decode(fp, stdout);
+	fclose(fp);
+	if (!ret)
+	{
+		fprintf(stderr, "invalid trace file\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,147 @@
+#include "trace.h"
+#include "cpu/instr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "GBATRACE"
+#define TRACE_VERSION 1
+#define TRACE_FLAG_REGS (1 << 0)
+
+typedef struct trace_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t count;
+} trace_header_t;
+
+trace_t *trace_new(size_t size, bool regs)
+{
+	trace_t *trace = calloc(sizeof(*trace), 1);
+	if (!trace)
+		return NULL;
+
+	trace->size = 1;
+	while (trace->size < size)
+		trace->size <<= 1;
+	trace->entries = malloc(sizeof(*trace->entries) * trace->size);
+	if (!trace->entries)
+		goto err;
+	if (regs)
+	{
+		trace->regs = malloc(sizeof(*trace->regs) * trace->size);
+		if (!trace->regs)
+			goto err;
+	}
+	return trace;
+
+err:
+	trace_del(trace);
+	return NULL;
+}
+
+void trace_del(trace_t *trace)
+{
+	if (!trace)
+		return;
+	free(trace->regs);
+	free(trace->entries);
+	free(trace);
+}
+
+bool trace_save(trace_t *trace, FILE *fp)
+{
+	trace_header_t header;
+	uint64_t count = trace->head < trace->size ? trace->head : trace->size;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.flags = trace->regs ? TRACE_FLAG_REGS : 0;
+	header.count = count;
+	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		return false;
+	for (uint64_t n = trace->head - count; n < trace->head; ++n)
+	{
+		size_t i = n & (trace->size - 1);
+		if (fwrite(&trace->entries[i], sizeof(*trace->entries), 1, fp) != 1)
+			return false;
+		if (trace->regs && fwrite(&trace->regs[i], sizeof(*trace->regs), 1, fp) != 1)
+			return false;
+	}
+	return true;
+}
+
+static void print_entry(cpu_t *cpu, const trace_entry_t *entry, FILE *out)
+{
+	const cpu_instr_t *instr;
+	char tmp[256] = "";
+
+	cpu->regs.cpsr = entry->cpsr;
+	cpu_update_mode(cpu);
+	cpu->instr_opcode = entry->opcode;
+	if (entry->cpsr & CPU_FLAG_T)
+		instr = cpu_instr_thumb[(entry->opcode >> 6) & 0x3FF];
+	else
+		instr = cpu_instr_arm[((entry->opcode >> 16) & 0xFF0) | ((entry->opcode >> 4) & 0xF)];
+	if (instr->print)
+		instr->print(cpu, tmp, sizeof(tmp));
+	fprintf(out, "[%08x] [%-4s] [%08x] [%08x] [%0*x] %s\n",
+	        entry->cycle,
+	        (entry->pc & TRACE_SKIPPED) ? "SKIP" : "EXEC",
+	        entry->pc & ~TRACE_SKIPPED,
+	        entry->cpsr,
+	        (entry->cpsr & CPU_FLAG_T) ? 4 : 8,
+	        entry->opcode,
+	        tmp);
+}
+
+static void print_regs(const uint32_t *regs, const uint32_t *prev, FILE *out)
+{
+	bool any = false;
+	for (size_t r = 0; r < 16; ++r)
+	{
+		if (prev && regs[r] == prev[r])
+			continue;
+		fprintf(out, "%sr%02zu=%08x", any ? " " : "           ", r, regs[r]);
+		any = true;
+	}
+	if (any)
+		fprintf(out, "\n");
+}
+
+bool trace_decode(FILE *in, FILE *out)
+{
+	trace_header_t header;
+	if (fread(&header, sizeof(header), 1, in) != 1
+	 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+	 || header.version != TRACE_VERSION)
+		return false;
+
+	/* the print callbacks only decode the opcode and may look at the registers */
+	cpu_t *cpu = cpu_new(NULL);
+	if (!cpu)
+		return false;
+	uint32_t regs[2][16];
+	bool ret = true;
+	for (uint64_t i = 0; i < header.count; ++i)
+	{
+		trace_entry_t entry;
+		if (fread(&entry, sizeof(entry), 1, in) != 1)
+		{
+			ret = false;
+			break;
+		}
+		if (header.flags & TRACE_FLAG_REGS)
+		{
+			if (fread(regs[i & 1], sizeof(regs[0]), 1, in) != 1)
+			{
+				ret = false;
+				break;
+			}
+			print_regs(regs[i & 1], i ? regs[(i & 1) ^ 1] : NULL, out);
+		}
+		print_entry(cpu, &entry, out);
+	}
+	cpu_del(cpu);
+	return ret;
+}
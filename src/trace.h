@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_SKIPPED (1 << 0) /* set in pc for instructions failing their condition */
+
+typedef struct trace_entry_s
+{
+	uint32_t pc;
+	uint32_t opcode;
+	uint32_t cpsr;
+	uint32_t cycle;
+} trace_entry_t;
+
+/*
+ * single producer ring of the last executed instructions, written from
+ * the emulation thread without locks and read back with trace_save
+ */
+typedef struct trace_s
+{
+	trace_entry_t *entries;
+	uint32_t (*regs)[16]; /* optional, registers before each instruction */
+	size_t size;
+	uint64_t head;
+} trace_t;
+
+trace_t *trace_new(size_t size, bool regs);
+void trace_del(trace_t *trace);
+
+bool trace_save(trace_t *trace, FILE *fp);
+bool trace_decode(FILE *in, FILE *out);
+
+static inline void trace_add(trace_t *trace, cpu_t *cpu, uint32_t flags, uint32_t cycle)
+{
+	size_t i = trace->head & (trace->size - 1);
+	trace_entry_t *entry = &trace->entries[i];
+	entry->pc = cpu_get_reg(cpu, CPU_REG_PC) | flags;
+	entry->opcode = cpu->instr_opcode;
+	entry->cpsr = cpu->regs.cpsr;
+	entry->cycle = cycle;
+	if (trace->regs)
+	{
+		for (size_t r = 0; r < 16; ++r)
+			trace->regs[i][r] = cpu_get_reg(cpu, r);
+	}
+	trace->head++;
+}
+
+#endif